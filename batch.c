@@ -0,0 +1,199 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "worker.h"
+
+// The instances are split into one contiguous range per thread. Range 0
+// runs on the calling thread, the others on their own worker.
+typedef struct BatchRange {
+	Uw8Batch* batch;
+	uint32_t first;
+	uint32_t end;
+	bool ok;
+	// arguments of the current step
+	const uint8_t* inputs;
+	uint8_t* frames;
+	float* rewards;
+} BatchRange;
+
+struct Uw8Batch {
+	const uint8_t* cart; // only read while the instances are created
+	size_t cartSize;
+	uint32_t count;
+	Uw8Core** cores;
+	uint32_t threads;
+	Worker** workers; // threads - 1 of them
+	BatchRange* ranges;
+	Uw8Reward rewards[UW8_BATCH_MAX_REWARDS];
+	uint32_t rewardCount;
+};
+
+static float
+readReward(const uint8_t* memory, const Uw8Reward* reward)
+{
+	if(reward->address >= UW8_MEMORY_SIZE)
+		return 0;
+	switch(reward->type) {
+	case UW8_REWARD_U8:
+		return memory[reward->address];
+	case UW8_REWARD_F32: {
+		if(reward->address > UW8_MEMORY_SIZE - 4)
+			return 0;
+		float f;
+		memcpy(&f, memory + reward->address, sizeof(f));
+		return f;
+	}
+	default: {
+		if(reward->address > UW8_MEMORY_SIZE - 4)
+			return 0;
+		int32_t i;
+		memcpy(&i, memory + reward->address, sizeof(i));
+		return (float)i;
+	}
+	}
+}
+
+static void
+loadRange(void* arg)
+{
+	BatchRange* range = arg;
+	Uw8Batch* batch = range->batch;
+	range->ok = true;
+	for(uint32_t i = range->first; i < range->end; ++i) {
+		batch->cores[i] = uw8Create();
+		if(batch->cores[i] == NULL || !uw8Load(batch->cores[i], batch->cart, batch->cartSize, false))
+			range->ok = false;
+	}
+}
+
+static void
+stepRange(void* arg)
+{
+	BatchRange* range = arg;
+	Uw8Batch* batch = range->batch;
+	for(uint32_t i = range->first; i < range->end; ++i) {
+		Uw8Core* core = batch->cores[i];
+		uw8RunFrame(core, range->inputs + i * 4);
+		const uint8_t* memory = uw8Memory(core);
+		if(range->frames)
+			memcpy(range->frames + (size_t)i * 320 * 240, memory + UW8_FRAMEBUFFER, 320 * 240);
+		if(range->rewards)
+			for(uint32_t r = 0; r < batch->rewardCount; ++r)
+				range->rewards[i * batch->rewardCount + r] = readReward(memory, &batch->rewards[r]);
+	}
+}
+
+static void
+runRanges(Uw8Batch* batch, WorkerJob job)
+{
+	for(uint32_t t = 1; t < batch->threads; ++t)
+		workerStart(batch->workers[t - 1], job, &batch->ranges[t]);
+	job(&batch->ranges[0]);
+	for(uint32_t t = 1; t < batch->threads; ++t)
+		workerWait(batch->workers[t - 1]);
+}
+
+Uw8Batch*
+uw8BatchCreate(const uint8_t* cart, size_t cartSize, uint32_t count, uint32_t threads)
+{
+	if(count == 0)
+		return NULL;
+	if(threads == 0 || threads > count)
+		threads = count;
+
+	Uw8Batch* batch = calloc(1, sizeof(Uw8Batch));
+	if(batch == NULL)
+		return NULL;
+	batch->cart = cart;
+	batch->cartSize = cartSize;
+	batch->count = count;
+	batch->cores = calloc(count, sizeof(Uw8Core*));
+	batch->workers = calloc(threads, sizeof(Worker*));
+	batch->ranges = calloc(threads, sizeof(BatchRange));
+	if(batch->cores == NULL || batch->workers == NULL || batch->ranges == NULL) {
+		uw8BatchDestroy(batch);
+		return NULL;
+	}
+
+	// fewer threads if the system runs out of them
+	batch->threads = 1;
+	while(batch->threads < threads) {
+		Worker* worker = workerCreate();
+		if(worker == NULL)
+			break;
+		batch->workers[batch->threads++ - 1] = worker;
+	}
+	for(uint32_t t = 0; t < batch->threads; ++t) {
+		batch->ranges[t].batch = batch;
+		batch->ranges[t].first = (uint32_t)((uint64_t)count * t / batch->threads);
+		batch->ranges[t].end = (uint32_t)((uint64_t)count * (t + 1) / batch->threads);
+	}
+
+	runRanges(batch, loadRange);
+	for(uint32_t t = 0; t < batch->threads; ++t) {
+		if(!batch->ranges[t].ok) {
+			uw8BatchDestroy(batch);
+			return NULL;
+		}
+	}
+	return batch;
+}
+
+void
+uw8BatchDestroy(Uw8Batch* batch)
+{
+	if(batch == NULL)
+		return;
+	if(batch->workers)
+		for(uint32_t t = 1; t < batch->threads; ++t)
+			workerDestroy(batch->workers[t - 1]);
+	if(batch->cores)
+		for(uint32_t i = 0; i < batch->count; ++i)
+			uw8Destroy(batch->cores[i]);
+	free(batch->cores);
+	free(batch->workers);
+	free(batch->ranges);
+	free(batch);
+}
+
+bool
+uw8BatchSetRewards(Uw8Batch* batch, const Uw8Reward* rewards, uint32_t rewardCount)
+{
+	if(rewardCount > UW8_BATCH_MAX_REWARDS)
+		return false;
+	memcpy(batch->rewards, rewards, rewardCount * sizeof(Uw8Reward));
+	batch->rewardCount = rewardCount;
+	return true;
+}
+
+void
+uw8BatchStep(Uw8Batch* batch, const uint8_t* inputs, uint8_t* frames, float* rewards)
+{
+	for(uint32_t t = 0; t < batch->threads; ++t) {
+		batch->ranges[t].inputs = inputs;
+		batch->ranges[t].frames = frames;
+		batch->ranges[t].rewards = rewards;
+	}
+	runRanges(batch, stepRange);
+}
+
+void
+uw8BatchReset(Uw8Batch* batch, uint32_t index)
+{
+	if(index < batch->count)
+		uw8Reset(batch->cores[index]);
+}
+
+uint32_t
+uw8BatchCount(Uw8Batch* batch)
+{
+	return batch->count;
+}
+
+Uw8Core*
+uw8BatchCore(Uw8Batch* batch, uint32_t index)
+{
+	return index < batch->count ? batch->cores[index] : NULL;
+}
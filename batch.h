@@ -0,0 +1,43 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uw8.h"
+
+// Many instances of one cart, stepped together on a pool of threads, for
+// workloads like training agents that want raw frames rather than a
+// frontend. Every instance stays on the same thread for the whole batch.
+typedef struct Uw8Batch Uw8Batch;
+
+typedef enum Uw8RewardType {
+	UW8_REWARD_I32,
+	UW8_REWARD_U8,
+	UW8_REWARD_F32,
+} Uw8RewardType;
+
+// A value the cart keeps in its memory, read after every step.
+typedef struct Uw8Reward {
+	uint32_t address;
+	Uw8RewardType type;
+} Uw8Reward;
+
+// threads includes the calling thread; 0 picks one per instance.
+Uw8Batch* uw8BatchCreate(const uint8_t* cart, size_t cartSize, uint32_t count, uint32_t threads);
+void uw8BatchDestroy(Uw8Batch* batch);
+
+// Replaces the rewards read per step, at most UW8_BATCH_MAX_REWARDS.
+#define UW8_BATCH_MAX_REWARDS 16
+bool uw8BatchSetRewards(Uw8Batch* batch, const Uw8Reward* rewards, uint32_t rewardCount);
+
+// Runs one frame on every instance. inputs holds four gamepad bytes per
+// instance. frames, if not NULL, receives the 320x240 palette indices of
+// each instance and rewards, if not NULL, rewardCount values per instance.
+void uw8BatchStep(Uw8Batch* batch, const uint8_t* inputs, uint8_t* frames, float* rewards);
+
+void uw8BatchReset(Uw8Batch* batch, uint32_t index);
+uint32_t uw8BatchCount(Uw8Batch* batch);
+Uw8Core* uw8BatchCore(Uw8Batch* batch, uint32_t index);
+
+#endif
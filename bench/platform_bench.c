@@ -0,0 +1,182 @@
+// Microbenchmarks for the wasm2c platform exports, run against a standalone
+// 256 KiB memory. Every case is a parameter sweep of one primitive. Results
+// go to stdout as tab separated values: case, calls, ns per call and pixels
+// (the nominal number touched per call) per ns. The optional argument only
+// runs the cases whose name contains it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "env.h"
+#include "text.h"
+#include "timing.h"
+#include "uw8.h"
+
+#define MIN_MICROS 200000
+
+#define SPRITE_ADDRESS 0x20000
+#define STRING_ADDRESS 0x30000
+
+typedef struct Bench {
+	struct Z_env_instance_t env;
+	Z_platform_instance_t platform;
+	GlyphCache glyphs;
+} Bench;
+
+typedef struct BenchCase {
+	const char* name;
+	void (*run)(Bench* bench, uint32_t i);
+	double pixels; // per call, 0 where it makes no sense
+} BenchCase;
+
+// positions that move around the screen, partly outside of it
+static float
+sweepX(uint32_t i, float margin)
+{
+	return (float)(i * 37 % (uint32_t)(320 + 2 * margin)) - margin;
+}
+
+static float
+sweepY(uint32_t i, float margin)
+{
+	return (float)(i * 53 % (uint32_t)(240 + 2 * margin)) - margin;
+}
+
+static void runCls(Bench* b, uint32_t i) { Z_platformZ_cls(&b->platform, i & 0xff); }
+static void runSetPixel(Bench* b, uint32_t i) { Z_platformZ_setPixel(&b->platform, i * 37 % 320, i * 53 % 240, i & 0xff); }
+static void runGetPixel(Bench* b, uint32_t i) { Z_platformZ_getPixel(&b->platform, i * 37 % 320, i * 53 % 240); }
+static void runHline16(Bench* b, uint32_t i) { uint32_t x = i * 37 % 304; Z_platformZ_hline(&b->platform, x, x + 16, i % 240, i & 0xff); }
+static void runHline320(Bench* b, uint32_t i) { Z_platformZ_hline(&b->platform, 0, 320, i % 240, i & 0xff); }
+static void runHlineClipped(Bench* b, uint32_t i) { Z_platformZ_hline(&b->platform, (uint32_t)-64, 400, i % 240, i & 0xff); }
+static void runRectangle8(Bench* b, uint32_t i) { Z_platformZ_rectangle(&b->platform, sweepX(i, 0) * 0.9f, sweepY(i, 0) * 0.9f, 8, 8, i & 0xff); }
+static void runRectangle64(Bench* b, uint32_t i) { Z_platformZ_rectangle(&b->platform, sweepX(i, 0) * 0.7f, sweepY(i, 0) * 0.7f, 64, 64, i & 0xff); }
+static void runRectangleClipped(Bench* b, uint32_t i) { Z_platformZ_rectangle(&b->platform, sweepX(i, 64), sweepY(i, 64), 128, 128, i & 0xff); }
+static void runRectangleOutline(Bench* b, uint32_t i) { Z_platformZ_rectangleOutline(&b->platform, sweepX(i, 0) * 0.7f, sweepY(i, 0) * 0.7f, 64, 64, i & 0xff); }
+static void runCircle4(Bench* b, uint32_t i) { Z_platformZ_circle(&b->platform, sweepX(i, 0), sweepY(i, 0), 4, i & 0xff); }
+static void runCircle32(Bench* b, uint32_t i) { Z_platformZ_circle(&b->platform, sweepX(i, 0), sweepY(i, 0), 32, i & 0xff); }
+static void runCircle120(Bench* b, uint32_t i) { Z_platformZ_circle(&b->platform, 160, 120, 120, i & 0xff); }
+static void runCircleClipped(Bench* b, uint32_t i) { Z_platformZ_circle(&b->platform, sweepX(i, 100), sweepY(i, 100), 80, i & 0xff); }
+static void runCircleOutline(Bench* b, uint32_t i) { Z_platformZ_circleOutline(&b->platform, sweepX(i, 0), sweepY(i, 0), 32, i & 0xff); }
+static void runLineShort(Bench* b, uint32_t i) { float x = sweepX(i, 0), y = sweepY(i, 0); Z_platformZ_line(&b->platform, x, y, x + 10, y + 7, i & 0xff); }
+static void runLineLong(Bench* b, uint32_t i) { Z_platformZ_line(&b->platform, 0, sweepY(i, 0), 319, 239 - sweepY(i, 0), i & 0xff); }
+static void runLineClipped(Bench* b, uint32_t i) { Z_platformZ_line(&b->platform, -500, sweepY(i, 200), 800, sweepY(i + 1, 200), i & 0xff); }
+static void runBlit8(Bench* b, uint32_t i) { Z_platformZ_blitSprite(&b->platform, SPRITE_ADDRESS, 8, (uint32_t)sweepX(i, 0), (uint32_t)sweepY(i, 0), 0); }
+static void runBlit32(Bench* b, uint32_t i) { Z_platformZ_blitSprite(&b->platform, SPRITE_ADDRESS, 32, (uint32_t)sweepX(i, 0), (uint32_t)sweepY(i, 0), 0); }
+static void runBlit32Transparent(Bench* b, uint32_t i) { Z_platformZ_blitSprite(&b->platform, SPRITE_ADDRESS, 32, (uint32_t)sweepX(i, 0), (uint32_t)sweepY(i, 0), 0x100); }
+static void runBlit32Flipped(Bench* b, uint32_t i) { Z_platformZ_blitSprite(&b->platform, SPRITE_ADDRESS, 32, (uint32_t)sweepX(i, 0), (uint32_t)sweepY(i, 0), 0x600); }
+static void runBlit32Clipped(Bench* b, uint32_t i) { Z_platformZ_blitSprite(&b->platform, SPRITE_ADDRESS, 32, (uint32_t)(int32_t)sweepX(i, 32), (uint32_t)(int32_t)sweepY(i, 32), 0x100); }
+static void runGrab32(Bench* b, uint32_t i) { Z_platformZ_grabSprite(&b->platform, SPRITE_ADDRESS + 0x1000, 32, (uint32_t)sweepX(i, 0) * 7 / 8, (uint32_t)sweepY(i, 0) * 7 / 8, 0); }
+
+// in characters, leaving room for the string without wrapping or scrolling
+static void
+moveCursor(Bench* b, uint32_t i)
+{
+	Z_platformZ_setCursorPosition(&b->platform, i % 16, i % 29);
+}
+
+static void runPrintChar(Bench* b, uint32_t i) { moveCursor(b, i); Z_platformZ_printChar(&b->platform, 'A' + i % 26); }
+static void runPrintCharNative(Bench* b, uint32_t i) { moveCursor(b, i); textPrintChar(&b->platform, &b->glyphs, 'A' + i % 26); }
+static void runPrintString(Bench* b, uint32_t i) { moveCursor(b, i); Z_platformZ_printString(&b->platform, STRING_ADDRESS); }
+static void runPrintStringNative(Bench* b, uint32_t i) { moveCursor(b, i); textPrintString(&b->platform, &b->glyphs, STRING_ADDRESS); }
+static void runPrintInt(Bench* b, uint32_t i) { moveCursor(b, i); Z_platformZ_printInt(&b->platform, i * 7919); }
+
+static void
+runSndGes(Bench* b, uint32_t i)
+{
+	if(i % 44100 == 0)
+		Z_platformZ_playNote(&b->platform, i / 44100 % 4, 48 + i / 44100 % 24);
+	Z_platformZ_sndGes(&b->platform, i);
+}
+
+static const BenchCase cases[] = {
+	{ "cls", runCls, 320 * 240 },
+	{ "setPixel", runSetPixel, 1 },
+	{ "getPixel", runGetPixel, 1 },
+	{ "hline/16", runHline16, 16 },
+	{ "hline/320", runHline320, 320 },
+	{ "hline/clipped", runHlineClipped, 320 },
+	{ "rectangle/8", runRectangle8, 8 * 8 },
+	{ "rectangle/64", runRectangle64, 64 * 64 },
+	{ "rectangle/clipped", runRectangleClipped, 0 },
+	{ "rectangleOutline/64", runRectangleOutline, 4 * 64 },
+	{ "circle/4", runCircle4, 3.14159 * 4 * 4 },
+	{ "circle/32", runCircle32, 3.14159 * 32 * 32 },
+	{ "circle/120", runCircle120, 3.14159 * 120 * 120 },
+	{ "circle/clipped", runCircleClipped, 0 },
+	{ "circleOutline/32", runCircleOutline, 2 * 3.14159 * 32 },
+	{ "line/short", runLineShort, 10 },
+	{ "line/long", runLineLong, 320 },
+	{ "line/clipped", runLineClipped, 0 },
+	{ "blitSprite/8", runBlit8, 8 * 8 },
+	{ "blitSprite/32", runBlit32, 32 * 32 },
+	{ "blitSprite/32/transparent", runBlit32Transparent, 32 * 32 },
+	{ "blitSprite/32/flipped", runBlit32Flipped, 32 * 32 },
+	{ "blitSprite/32/clipped", runBlit32Clipped, 0 },
+	{ "grabSprite/32", runGrab32, 32 * 32 },
+	{ "printChar", runPrintChar, 8 * 8 },
+	{ "printChar/native", runPrintCharNative, 8 * 8 },
+	{ "printString/24", runPrintString, 24 * 8 * 8 },
+	{ "printString/24/native", runPrintStringNative, 24 * 8 * 8 },
+	{ "printInt", runPrintInt, 0 },
+	{ "sndGes", runSndGes, 0 },
+};
+
+// A fresh platform for every case, so that no case inherits the text
+// cursor or sound state of the one before.
+static void
+resetBench(Bench* bench)
+{
+	memset(bench->env.memory.data, 0, UW8_MEMORY_SIZE);
+	memset(bench->env.reservedGlobals, 0, sizeof(bench->env.reservedGlobals));
+	Z_platform_instantiate(&bench->platform, &bench->env);
+	memset(&bench->glyphs, 0, sizeof(bench->glyphs));
+
+	uint8_t* memory = bench->env.memory.data;
+	uint32_t seed = 1;
+	for(uint32_t i = 0; i < 32 * 32; ++i) {
+		seed = seed * 1103515245 + 12345;
+		memory[SPRITE_ADDRESS + i] = (uint8_t)(seed >> 16) & 0x0f; // some transparent pixels
+	}
+	memcpy(memory + STRING_ADDRESS, "The quick brown fox 0123", 25);
+}
+
+int
+main(int argc, char** argv)
+{
+	const char* filter = argc > 1 ? argv[1] : NULL;
+	wasm_rt_init();
+	Z_platform_init_module();
+
+	Bench* bench = calloc(1, sizeof(Bench));
+	bench->env.memory.data = calloc(1, UW8_MEMORY_SIZE);
+	bench->env.memory.pages = bench->env.memory.max_pages = 4;
+	bench->env.memory.size = UW8_MEMORY_SIZE;
+
+	printf("case\tcalls\tns_per_call\tpixels_per_ns\n");
+	for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		const BenchCase* benchCase = &cases[c];
+		if(filter && strstr(benchCase->name, filter) == NULL)
+			continue;
+		resetBench(bench);
+
+		// double the batch until it runs long enough to time
+		uint32_t calls = 0, batch = 64;
+		uint64_t micros = 0;
+		while(micros < MIN_MICROS) {
+			uint64_t start = timeMicros();
+			for(uint32_t i = 0; i < batch; ++i)
+				benchCase->run(bench, calls + i);
+			micros += timeMicros() - start;
+			calls += batch;
+			if(batch < (1u << 20))
+				batch *= 2;
+		}
+		double ns = micros * 1000.0 / calls;
+		printf("%s\t%u\t%.2f\t%.3f\n", benchCase->name, calls, ns, benchCase->pixels / ns);
+	}
+
+	free(bench->env.memory.data);
+	free(bench);
+	return 0;
+}
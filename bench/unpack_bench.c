@@ -0,0 +1,344 @@
+// Checks the native cart unpacker against the wasm2c uw8 loader and
+// compares their speed. The carts given as arguments are the corpus;
+// without arguments carts are generated from the base module's sections,
+// upkr-compressed and stored. Results go to stdout as tab separated
+// values: cart, cart bytes, module bytes, native and wasm2c MB/s of module
+// output and whether both produced the same bytes, then the mean speeds on
+// stderr. Exits with 1 on any difference. The wasm2c loader is instantiated
+// for every cart, which decompresses its base module each time, as the
+// core did before the native unpacker.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loader.h"
+#include "env.h"
+#include "unpack.h"
+#include "timing.h"
+
+#define MIN_MICROS 20000
+#define GENERATED_CARTS 200
+
+// The loader works in a 256 KiB memory. It moves the cart to 120 KiB and
+// writes the module from 0.
+#define LOADER_MEMORY (1 << 18)
+#define LOADER_MAX_CART (120 << 10)
+
+typedef struct Loader {
+	struct Z_env_instance_t env;
+	Z_loader_instance_t loader;
+} Loader;
+
+static uint8_t*
+loadReference(Loader* l, const uint8_t* cart, size_t cartSize, uint32_t* sizeOut)
+{
+	memset(l->env.memory.data, 0, LOADER_MEMORY);
+	Z_loader_instantiate(&l->loader, &l->env);
+	memcpy(l->env.memory.data, cart, cartSize);
+	*sizeOut = Z_loaderZ_load_uw8(&l->loader, (uint32_t)cartSize);
+	uint8_t* module = malloc(*sizeOut);
+	memcpy(module, l->env.memory.data, *sizeOut);
+	return module;
+}
+
+// A byte buffer that grows as needed.
+typedef struct Buffer {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} Buffer;
+
+static void
+bufferPush(Buffer* buffer, uint8_t byte)
+{
+	if(buffer->size == buffer->capacity) {
+		buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+	buffer->data[buffer->size++] = byte;
+}
+
+// upkr encoder matching upkrUncompress: the bits and their probabilities
+// are collected front to back, then range coded back to front.
+typedef struct UpkrBit {
+	uint8_t prob;
+	uint8_t bit;
+} UpkrBit;
+
+typedef struct UpkrEncoder {
+	uint8_t probs[385];
+	UpkrBit* bits;
+	size_t count;
+	size_t capacity;
+} UpkrEncoder;
+
+static void
+encodeBit(UpkrEncoder* e, int context, int bit)
+{
+	if(e->count == e->capacity) {
+		e->capacity = e->capacity ? e->capacity * 2 : 65536;
+		e->bits = realloc(e->bits, e->capacity * sizeof(UpkrBit));
+	}
+	uint32_t prob = e->probs[context];
+	e->bits[e->count].prob = (uint8_t)prob;
+	e->bits[e->count++].bit = (uint8_t)bit;
+	if(bit)
+		e->probs[context] = (uint8_t)(prob + ((264 - prob) >> 4));
+	else
+		e->probs[context] = (uint8_t)(prob - ((prob + 8) >> 4));
+}
+
+static void
+encodeNumber(UpkrEncoder* e, int context, uint32_t value)
+{
+	int bits = 0;
+	while((value >> (bits + 1)) != 0)
+		++bits;
+	for(int i = 0; i < bits; ++i) {
+		encodeBit(e, context + i, 1);
+		encodeBit(e, context + i + 32, (value >> i) & 1);
+	}
+	encodeBit(e, context + bits, 0);
+}
+
+static Buffer
+upkrCompress(const uint8_t* in, size_t size)
+{
+	UpkrEncoder e = { { 0 } };
+	memset(e.probs, 128, sizeof(e.probs));
+	uint32_t lastOffset = 0;
+	bool prevWasMatch = false;
+	for(size_t i = 0; i < size; ) {
+		// greedy longest match, the last offset first
+		size_t bestLength = 0, bestOffset = 0;
+		if(lastOffset && lastOffset <= i) {
+			size_t length = 0;
+			while(i + length < size && in[i + length] == in[i + length - lastOffset])
+				++length;
+			if(length >= 2) {
+				bestLength = length;
+				bestOffset = lastOffset;
+			}
+		}
+		for(size_t offset = 1; offset <= i && offset <= 4096; ++offset) {
+			size_t length = 0;
+			while(i + length < size && in[i + length] == in[i + length - offset])
+				++length;
+			if(length > bestLength + 1) {
+				bestLength = length;
+				bestOffset = offset;
+			}
+		}
+		if(bestLength >= 2) {
+			encodeBit(&e, 0, 1);
+			bool newOffset = prevWasMatch || bestOffset != lastOffset;
+			if(!prevWasMatch)
+				encodeBit(&e, 256, newOffset);
+			if(newOffset)
+				encodeNumber(&e, 257, (uint32_t)bestOffset + 1);
+			encodeNumber(&e, 321, (uint32_t)bestLength);
+			lastOffset = (uint32_t)bestOffset;
+			prevWasMatch = true;
+			i += bestLength;
+		} else {
+			encodeBit(&e, 0, 0);
+			uint32_t byte = 1;
+			for(int b = 7; b >= 0; --b) {
+				int bit = (in[i] >> b) & 1;
+				encodeBit(&e, byte, bit);
+				byte = (byte << 1) | bit;
+			}
+			prevWasMatch = false;
+			++i;
+		}
+	}
+	// end marker: a match with offset 0
+	encodeBit(&e, 0, 1);
+	if(!prevWasMatch)
+		encodeBit(&e, 256, 1);
+	encodeNumber(&e, 257, 1);
+
+	Buffer reversed = { 0 };
+	uint32_t state = 4096;
+	for(size_t i = e.count; i-- > 0; ) {
+		uint32_t prob = e.bits[i].prob;
+		uint32_t start = e.bits[i].bit ? 0 : prob;
+		uint32_t frequency = e.bits[i].bit ? prob : 256 - prob;
+		while(state >= 4096 * frequency) {
+			bufferPush(&reversed, (uint8_t)state);
+			state >>= 8;
+		}
+		state = (state / frequency) * 256 + state % frequency + start;
+	}
+	while(state) {
+		bufferPush(&reversed, (uint8_t)state);
+		state >>= 8;
+	}
+	free(e.bits);
+
+	Buffer out = { 0 };
+	for(size_t i = reversed.size; i-- > 0; )
+		bufferPush(&out, reversed.data[i]);
+	free(reversed.data);
+	return out;
+}
+
+// A cart of some of the base module's sections with a few bytes changed,
+// as version 2 (compressed) or 1 (stored).
+static Buffer
+generateCart(uint32_t seed, const uint8_t* base, uint32_t baseSize)
+{
+	Buffer body = { 0 };
+	const uint8_t* p = base + 8;
+	const uint8_t* end = base + baseSize;
+	while(p < end) {
+		const uint8_t* q = p + 1;
+		uint32_t size = 0;
+		uint8_t byte;
+		int shift = 0;
+		do {
+			byte = *q++;
+			size |= (uint32_t)(byte & 127) << shift;
+			shift += 7;
+		} while(byte & 128);
+		const uint8_t* next = q + size;
+		seed = seed * 1103515245 + 12345;
+		if(seed >> 30) {
+			size_t first = body.size;
+			for(const uint8_t* b = p; b < next; ++b)
+				bufferPush(&body, *b);
+			// change payload bytes only, the section headers have to stay valid
+			size_t header = (size_t)(q - p);
+			for(int i = 0; i < 4 && size > 0; ++i) {
+				seed = seed * 1103515245 + 12345;
+				body.data[first + header + (seed >> 8) % size] ^= (uint8_t)(seed >> 24);
+			}
+		}
+		p = next;
+	}
+
+	Buffer cart = { 0 };
+	if(seed & 1) {
+		bufferPush(&cart, 2);
+		Buffer compressed = upkrCompress(body.data, body.size);
+		for(size_t i = 0; i < compressed.size; ++i)
+			bufferPush(&cart, compressed.data[i]);
+		free(compressed.data);
+	} else {
+		bufferPush(&cart, 1);
+		for(size_t i = 0; i < body.size; ++i)
+			bufferPush(&cart, body.data[i]);
+	}
+	free(body.data);
+	return cart;
+}
+
+static Buffer
+readFile(const char* path)
+{
+	Buffer buffer = { 0 };
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return buffer;
+	int c;
+	while((c = fgetc(file)) != EOF)
+		bufferPush(&buffer, (uint8_t)c);
+	fclose(file);
+	return buffer;
+}
+
+// Runs unpack until it took long enough to time, in MB/s of module output.
+static double
+timeUnpack(Loader* loader, const uint8_t* cart, size_t cartSize, uint32_t moduleSize)
+{
+	uint32_t runs = 0;
+	uint64_t start = timeMicros(), micros = 0;
+	while(micros < MIN_MICROS) {
+		uint32_t size;
+		uint8_t* module = loader ? loadReference(loader, cart, cartSize, &size) : unpackUw8(cart, cartSize, &size);
+		free(module);
+		++runs;
+		micros = timeMicros() - start;
+	}
+	return (double)moduleSize * runs / micros;
+}
+
+// per cart version: 0 plain wasm, 1 stored, 2 compressed
+static double nativeTotal[3], referenceTotal[3];
+static uint32_t timedCarts[3];
+
+// Both unpackers on one cart, false if they disagree.
+static bool
+benchCart(Loader* loader, const char* name, const uint8_t* cart, size_t cartSize)
+{
+	if(cartSize > LOADER_MAX_CART) {
+		printf("%s\t%zu\t-\t-\t-\tskipped\n", name, cartSize);
+		return true;
+	}
+	uint32_t nativeSize = 0, referenceSize;
+	uint8_t* native = unpackUw8(cart, cartSize, &nativeSize);
+	uint8_t* reference = loadReference(loader, cart, cartSize, &referenceSize);
+	bool same = native && nativeSize == referenceSize && memcmp(native, reference, nativeSize) == 0;
+	free(native);
+	free(reference);
+	if(!same) {
+		printf("%s\t%zu\t%u\t-\t-\tdifferent\n", name, cartSize, referenceSize);
+		return false;
+	}
+	double nativeSpeed = timeUnpack(NULL, cart, cartSize, nativeSize);
+	double referenceSpeed = timeUnpack(loader, cart, cartSize, nativeSize);
+	printf("%s\t%zu\t%u\t%.1f\t%.1f\tsame\n", name, cartSize, nativeSize, nativeSpeed, referenceSpeed);
+	int version = cart[0] < 3 ? cart[0] : 2;
+	nativeTotal[version] += nativeSpeed;
+	referenceTotal[version] += referenceSpeed;
+	++timedCarts[version];
+	return true;
+}
+
+int
+main(int argc, char** argv)
+{
+	wasm_rt_init();
+	Z_loader_init_module();
+	unpackInit();
+	Loader* loader = calloc(1, sizeof(Loader));
+	loader->env.memory.data = calloc(1, LOADER_MEMORY);
+	loader->env.memory.pages = loader->env.memory.max_pages = 4;
+	loader->env.memory.size = LOADER_MEMORY;
+
+	printf("cart\tcart_bytes\tmodule_bytes\tnative_mb_s\twasm2c_mb_s\tresult\n");
+	bool ok = true;
+	if(argc > 1) {
+		for(int i = 1; i < argc; ++i) {
+			Buffer cart = readFile(argv[i]);
+			if(cart.size == 0) {
+				fprintf(stderr, "could not read %s\n", argv[i]);
+				ok = false;
+				continue;
+			}
+			ok = benchCart(loader, argv[i], cart.data, cart.size) && ok;
+			free(cart.data);
+		}
+	} else {
+		uint32_t baseSize;
+		const uint8_t* base = unpackBaseModule(&baseSize);
+		for(uint32_t i = 0; i < GENERATED_CARTS; ++i) {
+			Buffer cart = generateCart(i + 1, base, baseSize);
+			char name[32];
+			snprintf(name, sizeof(name), "generated/%u/v%u", i, cart.data[0]);
+			ok = benchCart(loader, name, cart.data, cart.size) && ok;
+			free(cart.data);
+		}
+	}
+
+	static const char* const versionNames[3] = { "plain", "stored", "compressed" };
+	for(int v = 0; v < 3; ++v)
+		if(timedCarts[v])
+			fprintf(stderr, "%u %s carts: native %.1f MB/s, wasm2c %.1f MB/s on average\n",
+				timedCarts[v], versionNames[v], nativeTotal[v] / timedCarts[v], referenceTotal[v] / timedCarts[v]);
+	unpackFree();
+	free(loader->env.memory.data);
+	free(loader);
+	return ok ? 0 : 1;
+}
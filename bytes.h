@@ -0,0 +1,26 @@
+#ifndef BYTES_H
+#define BYTES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes that leave the core are little-endian with fixed widths, so that
+// states and movies move between hosts of any endianness and pointer size.
+static inline uint8_t*
+putLe(uint8_t* out, uint64_t value, size_t size)
+{
+	for(size_t i = 0; i < size; ++i)
+		out[i] = (uint8_t)(value >> (8 * i));
+	return out + size;
+}
+
+static inline uint64_t
+getLe(const uint8_t* in, size_t size)
+{
+	uint64_t value = 0;
+	for(size_t i = 0; i < size; ++i)
+		value |= (uint64_t)in[i] << (8 * i);
+	return value;
+}
+
+#endif
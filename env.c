@@ -0,0 +1,23 @@
+#include "platform.h"
+#include "env.h"
+#include "uw8math.h"
+
+#define MATH1(name, function) \
+f32 Z_envZ_##name(struct Z_env_instance_t* i, f32 v) { \
+	return function(v); \
+}
+#define MATH2(name, function) \
+f32 Z_envZ_##name(struct Z_env_instance_t* i, f32 a, f32 b) { \
+	return function(a, b); \
+}
+MATH1(acos, uw8Acos); MATH1(asin, uw8Asin); MATH1(atan, uw8Atan); MATH2(atan2, uw8Atan2);
+MATH1(cos, uw8Cos); MATH1(sin, uw8Sin); MATH1(tan, uw8Tan);
+MATH1(exp, uw8Exp); MATH2(pow, uw8Pow);
+void Z_envZ_logChar(struct Z_env_instance_t* i, u32 c) {}
+
+#define G_RESERVED(n) u32* Z_envZ_g_reserved##n(struct Z_env_instance_t* i) { return &i->reservedGlobals[n]; }
+G_RESERVED(0); G_RESERVED(1); G_RESERVED(2); G_RESERVED(3);
+G_RESERVED(4); G_RESERVED(5); G_RESERVED(6); G_RESERVED(7);
+G_RESERVED(8); G_RESERVED(9); G_RESERVED(10); G_RESERVED(11);
+G_RESERVED(12); G_RESERVED(13); G_RESERVED(14); G_RESERVED(15);
+wasm_rt_memory_t* Z_envZ_memory(struct Z_env_instance_t* i) { return &i->memory; }
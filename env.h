@@ -0,0 +1,16 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdint.h>
+
+#include "wasm-rt.h"
+
+// What the wasm2c loader and platform modules import from "env": the linear
+// memory and the platform's reserved globals, separately for every runtime.
+// The imported functions are defined in env.c.
+struct Z_env_instance_t {
+	wasm_rt_memory_t memory;
+	uint32_t reservedGlobals[16];
+};
+
+#endif
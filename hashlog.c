@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashlog.h"
+
+struct HashLog {
+	FILE* file;
+};
+
+static uint64_t
+mix(uint64_t hash, uint64_t word)
+{
+	hash ^= word * 0x9e3779b97f4a7c15ull;
+	hash = (hash << 31) | (hash >> 33);
+	return hash * 0xff51afd7ed558ccdull;
+}
+
+uint64_t
+hashLogHash(const void* data, size_t size)
+{
+	const uint8_t* bytes = data;
+	uint64_t hash = size;
+	size_t i = 0;
+	for(; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		hash = mix(hash, word);
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + i, size - i);
+	hash = mix(hash, tail);
+	return hash ^ (hash >> 29);
+}
+
+HashLog*
+hashLogOpen(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if(file == NULL)
+		return NULL;
+	HashLog* log = malloc(sizeof(HashLog));
+	if(log == NULL) {
+		fclose(file);
+		return NULL;
+	}
+	log->file = file;
+	return log;
+}
+
+void
+hashLogFrame(HashLog* log, uint32_t frame, const FrameHashes* hashes)
+{
+	fprintf(log->file, "%u %016llx %016llx %016llx\n", frame,
+		(unsigned long long)hashes->framebuffer, (unsigned long long)hashes->palette,
+		(unsigned long long)hashes->audio);
+}
+
+void
+hashLogClose(HashLog* log)
+{
+	if(log == NULL)
+		return;
+	fclose(log->file);
+	free(log);
+}
+
+// 1 for a line, 0 at the end of the log, -1 for garbage
+static int
+readLine(FILE* file, uint32_t* frame, FrameHashes* hashes)
+{
+	unsigned f;
+	unsigned long long fb, palette, audio;
+	int n = fscanf(file, "%u %llx %llx %llx", &f, &fb, &palette, &audio);
+	if(n == EOF)
+		return 0;
+	if(n != 4)
+		return -1;
+	*frame = f;
+	hashes->framebuffer = fb;
+	hashes->palette = palette;
+	hashes->audio = audio;
+	return 1;
+}
+
+HashLogResult
+hashLogCompare(const char* pathA, const char* pathB, uint32_t* frame, const char** what)
+{
+	FILE* a = fopen(pathA, "r");
+	FILE* b = fopen(pathB, "r");
+	HashLogResult result = HASHLOG_ERROR;
+	*frame = 0;
+	*what = NULL;
+	while(a && b) {
+		uint32_t frameA = 0, frameB = 0;
+		FrameHashes hashesA = {0}, hashesB = {0};
+		int lineA = readLine(a, &frameA, &hashesA);
+		int lineB = readLine(b, &frameB, &hashesB);
+		if(lineA < 0 || lineB < 0)
+			break;
+		if(lineA == 0 || lineB == 0) {
+			result = lineA == lineB ? HASHLOG_EQUAL : HASHLOG_LENGTH;
+			*frame = lineA ? frameA : frameB;
+			break;
+		}
+		if(frameA != frameB)
+			break;
+		*frame = frameA;
+		if(hashesA.framebuffer != hashesB.framebuffer)
+			*what = "framebuffer";
+		else if(hashesA.palette != hashesB.palette)
+			*what = "palette";
+		else if(hashesA.audio != hashesB.audio)
+			*what = "audio";
+		if(*what) {
+			result = HASHLOG_DIFFERENT;
+			break;
+		}
+	}
+	if(a)
+		fclose(a);
+	if(b)
+		fclose(b);
+	return result;
+}
@@ -0,0 +1,37 @@
+#ifndef HASHLOG_H
+#define HASHLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Verification logs with one line of hashes per frame: the 8-bit
+// framebuffer, the palette and the frame's audio samples. Logs written by
+// two builds or option sets for the same cart and input movie have to be
+// identical; hashLogCompare finds the first frame where they are not.
+typedef struct HashLog HashLog;
+
+typedef struct FrameHashes {
+	uint64_t framebuffer;
+	uint64_t palette;
+	uint64_t audio;
+} FrameHashes;
+
+// Not cryptographic, just fast: 64 bits per multiply.
+uint64_t hashLogHash(const void* data, size_t size);
+
+HashLog* hashLogOpen(const char* path);
+void hashLogFrame(HashLog* log, uint32_t frame, const FrameHashes* hashes);
+void hashLogClose(HashLog* log);
+
+typedef enum HashLogResult {
+	HASHLOG_EQUAL,
+	HASHLOG_DIFFERENT,
+	HASHLOG_LENGTH, // one log ends early, the frames both have are equal
+	HASHLOG_ERROR, // a log could not be read
+} HashLogResult;
+
+// frame receives the first frame that differs or is missing in one log.
+// what is set to "framebuffer", "palette" or "audio" for differences.
+HashLogResult hashLogCompare(const char* pathA, const char* pathB, uint32_t* frame, const char** what);
+
+#endif
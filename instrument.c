@@ -0,0 +1,881 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instrument.h"
+
+static const char* const opNames[INSTRUMENT_OPS] = {
+	[0x00] = "unreachable", [0x01] = "nop", [0x02] = "block", [0x03] = "loop",
+	[0x04] = "if", [0x05] = "else", [0x0b] = "end", [0x0c] = "br",
+	[0x0d] = "br_if", [0x0e] = "br_table", [0x0f] = "return", [0x10] = "call",
+	[0x11] = "call_indirect", [0x1a] = "drop", [0x1b] = "select", [0x1c] = "select_t",
+	[0x20] = "local.get", [0x21] = "local.set", [0x22] = "local.tee",
+	[0x23] = "global.get", [0x24] = "global.set", [0x25] = "table.get", [0x26] = "table.set",
+	[0x28] = "i32.load", [0x29] = "i64.load", [0x2a] = "f32.load", [0x2b] = "f64.load",
+	[0x2c] = "i32.load8_s", [0x2d] = "i32.load8_u", [0x2e] = "i32.load16_s", [0x2f] = "i32.load16_u",
+	[0x30] = "i64.load8_s", [0x31] = "i64.load8_u", [0x32] = "i64.load16_s", [0x33] = "i64.load16_u",
+	[0x34] = "i64.load32_s", [0x35] = "i64.load32_u", [0x36] = "i32.store", [0x37] = "i64.store",
+	[0x38] = "f32.store", [0x39] = "f64.store", [0x3a] = "i32.store8", [0x3b] = "i32.store16",
+	[0x3c] = "i64.store8", [0x3d] = "i64.store16", [0x3e] = "i64.store32",
+	[0x3f] = "memory.size", [0x40] = "memory.grow",
+	[0x41] = "i32.const", [0x42] = "i64.const", [0x43] = "f32.const", [0x44] = "f64.const",
+	[0x45] = "i32.eqz", [0x46] = "i32.eq", [0x47] = "i32.ne", [0x48] = "i32.lt_s",
+	[0x49] = "i32.lt_u", [0x4a] = "i32.gt_s", [0x4b] = "i32.gt_u", [0x4c] = "i32.le_s",
+	[0x4d] = "i32.le_u", [0x4e] = "i32.ge_s", [0x4f] = "i32.ge_u",
+	[0x50] = "i64.eqz", [0x51] = "i64.eq", [0x52] = "i64.ne", [0x53] = "i64.lt_s",
+	[0x54] = "i64.lt_u", [0x55] = "i64.gt_s", [0x56] = "i64.gt_u", [0x57] = "i64.le_s",
+	[0x58] = "i64.le_u", [0x59] = "i64.ge_s", [0x5a] = "i64.ge_u",
+	[0x5b] = "f32.eq", [0x5c] = "f32.ne", [0x5d] = "f32.lt", [0x5e] = "f32.gt",
+	[0x5f] = "f32.le", [0x60] = "f32.ge",
+	[0x61] = "f64.eq", [0x62] = "f64.ne", [0x63] = "f64.lt", [0x64] = "f64.gt",
+	[0x65] = "f64.le", [0x66] = "f64.ge",
+	[0x67] = "i32.clz", [0x68] = "i32.ctz", [0x69] = "i32.popcnt", [0x6a] = "i32.add",
+	[0x6b] = "i32.sub", [0x6c] = "i32.mul", [0x6d] = "i32.div_s", [0x6e] = "i32.div_u",
+	[0x6f] = "i32.rem_s", [0x70] = "i32.rem_u", [0x71] = "i32.and", [0x72] = "i32.or",
+	[0x73] = "i32.xor", [0x74] = "i32.shl", [0x75] = "i32.shr_s", [0x76] = "i32.shr_u",
+	[0x77] = "i32.rotl", [0x78] = "i32.rotr",
+	[0x79] = "i64.clz", [0x7a] = "i64.ctz", [0x7b] = "i64.popcnt", [0x7c] = "i64.add",
+	[0x7d] = "i64.sub", [0x7e] = "i64.mul", [0x7f] = "i64.div_s", [0x80] = "i64.div_u",
+	[0x81] = "i64.rem_s", [0x82] = "i64.rem_u", [0x83] = "i64.and", [0x84] = "i64.or",
+	[0x85] = "i64.xor", [0x86] = "i64.shl", [0x87] = "i64.shr_s", [0x88] = "i64.shr_u",
+	[0x89] = "i64.rotl", [0x8a] = "i64.rotr",
+	[0x8b] = "f32.abs", [0x8c] = "f32.neg", [0x8d] = "f32.ceil", [0x8e] = "f32.floor",
+	[0x8f] = "f32.trunc", [0x90] = "f32.nearest", [0x91] = "f32.sqrt", [0x92] = "f32.add",
+	[0x93] = "f32.sub", [0x94] = "f32.mul", [0x95] = "f32.div", [0x96] = "f32.min",
+	[0x97] = "f32.max", [0x98] = "f32.copysign",
+	[0x99] = "f64.abs", [0x9a] = "f64.neg", [0x9b] = "f64.ceil", [0x9c] = "f64.floor",
+	[0x9d] = "f64.trunc", [0x9e] = "f64.nearest", [0x9f] = "f64.sqrt", [0xa0] = "f64.add",
+	[0xa1] = "f64.sub", [0xa2] = "f64.mul", [0xa3] = "f64.div", [0xa4] = "f64.min",
+	[0xa5] = "f64.max", [0xa6] = "f64.copysign",
+	[0xa7] = "i32.wrap_i64", [0xa8] = "i32.trunc_f32_s", [0xa9] = "i32.trunc_f32_u",
+	[0xaa] = "i32.trunc_f64_s", [0xab] = "i32.trunc_f64_u", [0xac] = "i64.extend_i32_s",
+	[0xad] = "i64.extend_i32_u", [0xae] = "i64.trunc_f32_s", [0xaf] = "i64.trunc_f32_u",
+	[0xb0] = "i64.trunc_f64_s", [0xb1] = "i64.trunc_f64_u", [0xb2] = "f32.convert_i32_s",
+	[0xb3] = "f32.convert_i32_u", [0xb4] = "f32.convert_i64_s", [0xb5] = "f32.convert_i64_u",
+	[0xb6] = "f32.demote_f64", [0xb7] = "f64.convert_i32_s", [0xb8] = "f64.convert_i32_u",
+	[0xb9] = "f64.convert_i64_s", [0xba] = "f64.convert_i64_u", [0xbb] = "f64.promote_f32",
+	[0xbc] = "i32.reinterpret_f32", [0xbd] = "i64.reinterpret_f64",
+	[0xbe] = "f32.reinterpret_i32", [0xbf] = "f64.reinterpret_i64",
+	[0xc0] = "i32.extend8_s", [0xc1] = "i32.extend16_s", [0xc2] = "i64.extend8_s",
+	[0xc3] = "i64.extend16_s", [0xc4] = "i64.extend32_s",
+	[0xd0] = "ref.null", [0xd1] = "ref.is_null", [0xd2] = "ref.func",
+	[256 + 0] = "i32.trunc_sat_f32_s", [256 + 1] = "i32.trunc_sat_f32_u",
+	[256 + 2] = "i32.trunc_sat_f64_s", [256 + 3] = "i32.trunc_sat_f64_u",
+	[256 + 4] = "i64.trunc_sat_f32_s", [256 + 5] = "i64.trunc_sat_f32_u",
+	[256 + 6] = "i64.trunc_sat_f64_s", [256 + 7] = "i64.trunc_sat_f64_u",
+	[256 + 8] = "memory.init", [256 + 9] = "data.drop", [256 + 10] = "memory.copy",
+	[256 + 11] = "memory.fill", [256 + 12] = "table.init", [256 + 13] = "elem.drop",
+	[256 + 14] = "table.copy", [256 + 15] = "table.grow", [256 + 16] = "table.size",
+	[256 + 17] = "table.fill",
+};
+
+const char*
+instrumentOpName(uint16_t op)
+{
+	return op < INSTRUMENT_OPS && opNames[op] ? opNames[op] : "unknown";
+}
+
+typedef struct Reader {
+	const uint8_t* p;
+	const uint8_t* end;
+	bool failed;
+} Reader;
+
+static uint8_t
+readByte(Reader* r)
+{
+	if(r->p >= r->end) {
+		r->failed = true;
+		return 0;
+	}
+	return *r->p++;
+}
+
+static uint32_t
+readLeb(Reader* r)
+{
+	uint32_t value = 0;
+	for(int shift = 0; shift < 35; shift += 7) {
+		uint8_t byte = readByte(r);
+		value |= (uint32_t)(byte & 127) << shift;
+		if(!(byte & 128))
+			return value;
+	}
+	r->failed = true;
+	return 0;
+}
+
+// Any LEB128 number, signed or not, up to 64 bits
+static void
+skipLeb(Reader* r)
+{
+	for(int i = 0; i < 10; ++i)
+		if(!(readByte(r) & 128))
+			return;
+	r->failed = true;
+}
+
+static void
+skipBytes(Reader* r, size_t size)
+{
+	if((size_t)(r->end - r->p) < size) {
+		r->failed = true;
+		return;
+	}
+	r->p += size;
+}
+
+typedef struct Buffer {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+	bool failed;
+} Buffer;
+
+static void
+putBytes(Buffer* b, const void* data, size_t size)
+{
+	if(b->size + size > b->capacity) {
+		size_t capacity = (b->size + size) * 2 + 256;
+		uint8_t* grown = b->failed ? NULL : realloc(b->data, capacity);
+		if(grown == NULL) {
+			b->failed = true;
+			return;
+		}
+		b->data = grown;
+		b->capacity = capacity;
+	}
+	memcpy(b->data + b->size, data, size);
+	b->size += size;
+}
+
+static void
+putByte(Buffer* b, uint8_t byte)
+{
+	putBytes(b, &byte, 1);
+}
+
+static void
+putLeb(Buffer* b, uint32_t value)
+{
+	do {
+		uint8_t byte = value & 127;
+		value >>= 7;
+		putByte(b, value ? byte | 128 : byte);
+	} while(value);
+}
+
+// Reads one instruction including its immediates and returns its opcode,
+// INSTRUMENT_OPS for instructions not known here.
+static uint16_t
+readInstruction(Reader* r)
+{
+	uint16_t op = readByte(r);
+	switch(op) {
+	case 0x02: case 0x03: case 0x04: // block types are s33
+	case 0x0c: case 0x0d: case 0x10:
+	case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: case 0x25: case 0x26:
+	case 0x3f: case 0x40: case 0x41: case 0x42: case 0xd2:
+		skipLeb(r);
+		break;
+	case 0x0e:
+		for(uint32_t n = readLeb(r) + 1; n > 0 && !r->failed; --n)
+			skipLeb(r);
+		break;
+	case 0x11:
+		skipLeb(r);
+		skipLeb(r);
+		break;
+	case 0x1c:
+		skipBytes(r, readLeb(r));
+		break;
+	case 0x43:
+		skipBytes(r, 4);
+		break;
+	case 0x44:
+		skipBytes(r, 8);
+		break;
+	case 0xd0:
+		skipBytes(r, 1);
+		break;
+	case 0xfc: {
+		uint32_t sub = readLeb(r);
+		if(sub > 17)
+			return INSTRUMENT_OPS;
+		op = (uint16_t)(256 + sub);
+		if(sub == 8 || sub == 10 || sub == 12 || sub == 14)
+			skipLeb(r);
+		if(sub >= 8)
+			skipLeb(r);
+		break;
+	}
+	default:
+		if(op >= 0x28 && op <= 0x3e) { // memarg
+			skipLeb(r);
+			skipLeb(r);
+		}
+		break;
+	}
+	return r->failed || opNames[op] == NULL ? INSTRUMENT_OPS : op;
+}
+
+// Instructions after which the next one may run a different number of
+// times: branches and the starts and ends of conditional or looping code.
+static bool
+endsRun(uint16_t op)
+{
+	switch(op) {
+	case 0x00: case 0x03: case 0x04: case 0x05: case 0x0b:
+	case 0x0c: case 0x0d: case 0x0e: case 0x0f:
+		return true;
+	default:
+		return false;
+	}
+}
+
+typedef struct Rewriter {
+	unsigned flags;
+	Instrumentation* info;
+	uint32_t pairCapacity;
+	// INSTRUMENT_CALLS
+	uint32_t functionImports; // in the original module
+	uint32_t enterFunction; // the leave import follows
+	uint32_t enterType; // the leave type follows
+	int64_t* blockTypes; // per defined function, the wrapping block's s33 type
+	uint32_t definedCount;
+} Rewriter;
+
+static void
+putSleb(Buffer* b, int64_t value)
+{
+	for(;;) {
+		uint8_t byte = value & 127;
+		value >>= 7;
+		if((value == 0 && !(byte & 64)) || (value == -1 && (byte & 64))) {
+			putByte(b, byte);
+			return;
+		}
+		putByte(b, byte | 128);
+	}
+}
+
+static void
+putName(Buffer* b, const char* name)
+{
+	putLeb(b, (uint32_t)strlen(name));
+	putBytes(b, name, strlen(name));
+}
+
+// Function index in the instrumented module
+static uint32_t
+shiftFunction(const Rewriter* rw, uint32_t index)
+{
+	return (rw->flags & INSTRUMENT_CALLS) && index >= rw->functionImports ? index + 2 : index;
+}
+
+static bool
+addPair(Rewriter* rw, uint16_t first, uint16_t second)
+{
+	Instrumentation* info = rw->info;
+	if(info->pairCount == rw->pairCapacity) {
+		uint32_t capacity = rw->pairCapacity ? rw->pairCapacity * 2 : 1024;
+		OpPair* pairs = realloc(info->pairs, capacity * sizeof(OpPair));
+		if(pairs == NULL)
+			return false;
+		info->pairs = pairs;
+		rw->pairCapacity = capacity;
+	}
+	OpPair* pair = &info->pairs[info->pairCount++];
+	pair->block = info->blockCount - 1;
+	pair->first = first;
+	pair->second = second;
+	return true;
+}
+
+// global.get, i64.const 1, i64.add, global.set on the next block's counter
+static void
+countBlock(Rewriter* rw, Buffer* out)
+{
+	uint32_t global = rw->info->firstCounter + rw->info->blockCount++;
+	putByte(out, 0x23);
+	putLeb(out, global);
+	putByte(out, 0x42);
+	putByte(out, 1);
+	putByte(out, 0x7c);
+	putByte(out, 0x24);
+	putLeb(out, global);
+}
+
+// Copies one instruction, with the function indices of calls and ref.func
+// adjusted to the instrumented module.
+static void
+copyInstruction(Rewriter* rw, uint16_t op, const uint8_t* start, const uint8_t* end, Buffer* out)
+{
+	if((op == 0x10 || op == 0xd2) && (rw->flags & INSTRUMENT_CALLS)) {
+		Reader immediate = { start + 1, end, false };
+		putByte(out, (uint8_t)op);
+		putLeb(out, shiftFunction(rw, readLeb(&immediate)));
+		return;
+	}
+	putBytes(out, start, (size_t)(end - start));
+}
+
+// With INSTRUMENT_CALLS the body becomes
+//   i32.const <function> call enter block <results> ... end call leave end
+// where returns turn into branches to the end of the added block, just
+// like branches to the function's own label already do.
+static bool
+rewriteBody(Rewriter* rw, uint32_t function, Reader* body, Buffer* out)
+{
+	// the locals stay as they are
+	const uint8_t* start = body->p;
+	for(uint32_t n = readLeb(body); n > 0 && !body->failed; --n) {
+		skipLeb(body);
+		skipBytes(body, 1);
+	}
+	putBytes(out, start, (size_t)(body->p - start));
+	bool calls = rw->flags & INSTRUMENT_CALLS;
+	if(calls) {
+		putByte(out, 0x41);
+		putSleb(out, function);
+		putByte(out, 0x10);
+		putLeb(out, rw->enterFunction);
+		putByte(out, 0x02);
+		putSleb(out, rw->blockTypes[function - rw->functionImports]);
+	}
+
+	bool runStart = true;
+	uint16_t previous = INSTRUMENT_OPS;
+	uint32_t depth = 0; // open blocks, loops and ifs
+	bool ended = false;
+	while(body->p < body->end && !body->failed) {
+		start = body->p;
+		uint16_t op = readInstruction(body);
+		if(op == INSTRUMENT_OPS || ended)
+			return false;
+		if(rw->flags & INSTRUMENT_BLOCKS) {
+			if(runStart && !endsRun(op)) {
+				// runs of a single instruction have no pairs to count
+				countBlock(rw, out);
+				runStart = false;
+			} else if(!runStart && !addPair(rw, previous, op)) {
+				return false;
+			}
+			previous = op;
+			if(endsRun(op))
+				runStart = true;
+		}
+		if(op == 0x0f && calls) {
+			putByte(out, 0x0c);
+			putLeb(out, depth);
+		} else {
+			copyInstruction(rw, op, start, body->p, out);
+		}
+		if(op == 0x02 || op == 0x03 || op == 0x04)
+			++depth;
+		else if(op == 0x0b && depth == 0)
+			ended = true;
+		else if(op == 0x0b)
+			--depth;
+	}
+	if(calls) {
+		putByte(out, 0x10);
+		putLeb(out, rw->enterFunction + 1);
+		putByte(out, 0x0b);
+	}
+	return ended && !body->failed;
+}
+
+static bool
+rewriteCode(Rewriter* rw, Reader section, Buffer* out)
+{
+	uint32_t count = readLeb(&section);
+	if((rw->flags & INSTRUMENT_CALLS) && count != rw->definedCount)
+		return false;
+	putLeb(out, count);
+	Buffer body = { 0 };
+	for(uint32_t i = 0; i < count && !section.failed; ++i) {
+		uint32_t size = readLeb(&section);
+		if(section.failed || size > (size_t)(section.end - section.p))
+			break;
+		Reader in = { section.p, section.p + size, false };
+		section.p += size;
+		body.size = 0;
+		if(!rewriteBody(rw, rw->functionImports + i, &in, &body) || body.failed) {
+			section.failed = true;
+			break;
+		}
+		putLeb(out, (uint32_t)body.size);
+		putBytes(out, body.data, body.size);
+	}
+	free(body.data);
+	return !section.failed && section.p == section.end;
+}
+
+// Copies a constant expression up to and including its end
+static bool
+rewriteExpression(Rewriter* rw, Reader* in, Buffer* out)
+{
+	for(;;) {
+		const uint8_t* start = in->p;
+		uint16_t op = readInstruction(in);
+		if(op == INSTRUMENT_OPS)
+			return false;
+		copyInstruction(rw, op, start, in->p, out);
+		if(op == 0x0b)
+			return true;
+	}
+}
+
+static bool
+rewriteElements(Rewriter* rw, Reader section, Buffer* out)
+{
+	uint32_t count = readLeb(&section);
+	putLeb(out, count);
+	for(uint32_t i = 0; i < count && !section.failed; ++i) {
+		uint32_t flags = readLeb(&section);
+		putLeb(out, flags);
+		if(flags > 7)
+			return false;
+		if(flags == 2 || flags == 6) // table index
+			putLeb(out, readLeb(&section));
+		if(!(flags & 1) && !rewriteExpression(rw, &section, out)) // offset
+			return false;
+		if(flags & 3) // element kind or reference type
+			putByte(out, readByte(&section));
+		uint32_t elements = readLeb(&section);
+		putLeb(out, elements);
+		for(uint32_t e = 0; e < elements && !section.failed; ++e) {
+			if(flags & 4) {
+				if(!rewriteExpression(rw, &section, out))
+					return false;
+			} else {
+				putLeb(out, shiftFunction(rw, readLeb(&section)));
+			}
+		}
+	}
+	return !section.failed && section.p == section.end;
+}
+
+static bool
+rewriteExports(Rewriter* rw, Reader section, Buffer* out)
+{
+	uint32_t count = readLeb(&section);
+	putLeb(out, count);
+	for(uint32_t i = 0; i < count && !section.failed; ++i) {
+		const uint8_t* name = section.p;
+		skipBytes(&section, readLeb(&section));
+		putBytes(out, name, (size_t)(section.p - name));
+		uint8_t kind = readByte(&section);
+		uint32_t index = readLeb(&section);
+		putByte(out, kind);
+		putLeb(out, kind == 0 ? shiftFunction(rw, index) : index);
+	}
+	return !section.failed && section.p == section.end;
+}
+
+// The name section's function names (1), local names (2) and label names
+// (3) are keyed by function index, the others are copied.
+static bool
+rewriteNames(Rewriter* rw, Reader section, Buffer* out)
+{
+	const uint8_t* start = section.p;
+	skipBytes(&section, readLeb(&section));
+	putBytes(out, start, (size_t)(section.p - start));
+	Buffer sub = { 0 };
+	while(section.p < section.end && !section.failed) {
+		uint8_t id = readByte(&section);
+		uint32_t size = readLeb(&section);
+		if(section.failed || size > (size_t)(section.end - section.p))
+			break;
+		Reader in = { section.p, section.p + size, false };
+		section.p += size;
+		sub.size = 0;
+		if(id >= 1 && id <= 3) {
+			uint32_t count = readLeb(&in);
+			putLeb(&sub, count);
+			for(uint32_t i = 0; i < count && !in.failed; ++i) {
+				putLeb(&sub, shiftFunction(rw, readLeb(&in)));
+				start = in.p;
+				if(id == 1) {
+					skipBytes(&in, readLeb(&in));
+				} else {
+					for(uint32_t n = readLeb(&in); n > 0 && !in.failed; --n) {
+						skipLeb(&in);
+						skipBytes(&in, readLeb(&in));
+					}
+				}
+				putBytes(&sub, start, (size_t)(in.p - start));
+			}
+			if(in.failed || in.p != in.end)
+				break;
+		} else {
+			putBytes(&sub, in.p, size);
+		}
+		putByte(out, id);
+		putLeb(out, (uint32_t)sub.size);
+		putBytes(out, sub.data, sub.size);
+	}
+	free(sub.data);
+	return !section.failed && !sub.failed && section.p == section.end;
+}
+
+// Appends the hooks' types and a result-only type for every function type
+// with several results, which the wrapping blocks need.
+static bool
+rewriteTypes(Rewriter* rw, Reader types, Reader functions, Buffer* out)
+{
+	uint32_t typeCount = readLeb(&types);
+	const uint8_t* entries = types.p;
+	uint32_t added = 2;
+	Buffer extra = { 0 };
+	putBytes(&extra, "\x60\x01\x7f\x00\x60\x00\x00", 7); // enter (i32), leave ()
+	int64_t* typeBlocks = calloc(typeCount + 1, sizeof(int64_t));
+	for(uint32_t i = 0; typeBlocks && i < typeCount && !types.failed; ++i) {
+		if(readByte(&types) != 0x60)
+			types.failed = true;
+		skipBytes(&types, readLeb(&types)); // parameters
+		const uint8_t* results = types.p;
+		uint32_t resultCount = readLeb(&types);
+		skipBytes(&types, resultCount);
+		if(resultCount == 0) {
+			typeBlocks[i] = -64;
+		} else if(resultCount == 1) {
+			typeBlocks[i] = (int64_t)types.p[-1] - 128;
+		} else {
+			typeBlocks[i] = typeCount + added++;
+			putBytes(&extra, "\x60\x00", 2);
+			putBytes(&extra, results, (size_t)(types.p - results));
+		}
+	}
+	rw->definedCount = readLeb(&functions);
+	rw->blockTypes = calloc(rw->definedCount + 1, sizeof(int64_t));
+	for(uint32_t i = 0; rw->blockTypes && typeBlocks && i < rw->definedCount; ++i) {
+		uint32_t type = readLeb(&functions);
+		if(type >= typeCount)
+			functions.failed = true;
+		else
+			rw->blockTypes[i] = typeBlocks[type];
+	}
+	bool ok = typeBlocks && rw->blockTypes && !types.failed && !functions.failed && !extra.failed;
+	putLeb(out, typeCount + added);
+	putBytes(out, entries, (size_t)(types.end - entries));
+	putBytes(out, extra.data, extra.size);
+	rw->enterFunction = rw->functionImports;
+	rw->enterType = typeCount;
+	free(extra.data);
+	free(typeBlocks);
+	return ok;
+}
+
+static void
+appendImports(Rewriter* rw, Reader imports, Buffer* out)
+{
+	uint32_t count = readLeb(&imports);
+	putLeb(out, count + 2);
+	putBytes(out, imports.p, (size_t)(imports.end - imports.p));
+	putName(out, "uw8profile");
+	putName(out, "enter");
+	putByte(out, 0);
+	putLeb(out, rw->enterType);
+	putName(out, "uw8profile");
+	putName(out, "leave");
+	putByte(out, 0);
+	putLeb(out, rw->enterType + 1);
+}
+
+// Skips an import's description, returns its kind
+static uint8_t
+skipImport(Reader* r)
+{
+	skipBytes(r, readLeb(r)); // module
+	skipBytes(r, readLeb(r)); // name
+	uint8_t kind = readByte(r);
+	switch(kind) {
+	case 0: // function: type index
+		skipLeb(r);
+		break;
+	case 1: // table: reference type, limits
+		skipBytes(r, 1);
+		// fall through
+	case 2: // memory: limits
+		if(readByte(r) & 1)
+			skipLeb(r);
+		skipLeb(r);
+		break;
+	case 3: // global: value type, mutability
+		skipBytes(r, 2);
+		break;
+	default:
+		r->failed = true;
+		break;
+	}
+	return kind;
+}
+
+// The number of imports of the given kind
+static uint32_t
+countImports(Reader section, uint8_t kind)
+{
+	uint32_t found = 0;
+	for(uint32_t n = readLeb(&section); n > 0 && !section.failed; --n)
+		found += skipImport(&section) == kind;
+	return section.failed ? UINT32_MAX : found;
+}
+
+// Position of a section id in the order the binary format requires, the
+// data count section comes before the code.
+static int
+sectionOrder(uint8_t id)
+{
+	return id == 12 ? 19 : id * 2;
+}
+
+#define MAX_SECTIONS 32
+#define SECTION_IDS 13
+
+typedef struct Section {
+	uint8_t id;
+	Reader payload;
+} Section;
+
+static int
+readSections(const uint8_t* wasm, uint32_t size, Section* sections)
+{
+	if(size < 8)
+		return -1;
+	int count = 0;
+	Reader module = { wasm + 8, wasm + size, false };
+	while(module.p < module.end) {
+		if(count == MAX_SECTIONS)
+			return -1;
+		Section* section = &sections[count++];
+		section->id = readByte(&module);
+		uint32_t payloadSize = readLeb(&module);
+		if(module.failed || section->id >= SECTION_IDS || payloadSize > (size_t)(module.end - module.p))
+			return -1;
+		section->payload = (Reader){ module.p, module.p + payloadSize, false };
+		module.p += payloadSize;
+	}
+	return count;
+}
+
+static const Section*
+findSection(const Section* sections, int count, uint8_t id)
+{
+	for(int i = 0; i < count; ++i)
+		if(sections[i].id == id)
+			return &sections[i];
+	return NULL;
+}
+
+static bool
+isNameSection(const Section* section)
+{
+	Reader payload = section->payload;
+	return section->id == 0 && readLeb(&payload) == 4 && (size_t)(payload.end - payload.p) >= 4
+		&& memcmp(payload.p, "name", 4) == 0;
+}
+
+static void
+putSection(Buffer* out, uint8_t id, const uint8_t* payload, size_t size)
+{
+	putByte(out, id);
+	putLeb(out, (uint32_t)size);
+	putBytes(out, payload, size);
+}
+
+uint8_t*
+instrumentModule(const uint8_t* wasm, uint32_t size, unsigned flags, Instrumentation* info, uint32_t* sizeOut)
+{
+	memset(info, 0, sizeof(*info));
+	info->flags = flags;
+	Section sections[MAX_SECTIONS];
+	int sectionCount = readSections(wasm, size, sections);
+	if(sectionCount < 0)
+		return NULL;
+	const Section* empty = &(Section){ 0, { (const uint8_t*)"", (const uint8_t*)"" + 1, false } };
+	const Section* types = findSection(sections, sectionCount, 1);
+	const Section* imports = findSection(sections, sectionCount, 2);
+	const Section* functions = findSection(sections, sectionCount, 3);
+	const Section* globals = findSection(sections, sectionCount, 6);
+
+	// the counters follow all globals the module has
+	Rewriter rw = { flags, info, 0, 0, 0, 0, NULL, 0 };
+	uint32_t functionImports = imports ? countImports(imports->payload, 0) : 0;
+	uint32_t globalImports = imports ? countImports(imports->payload, 3) : 0;
+	Reader globalCount = globals ? globals->payload : empty->payload;
+	info->firstCounter = globalImports + readLeb(&globalCount);
+	rw.functionImports = functionImports;
+	bool ok = functionImports < UINT32_MAX / 2 && globalImports < UINT32_MAX / 2 && !globalCount.failed;
+
+	// replacements by section id, built before anything is written since
+	// the global section needs the number of counters from the code
+	Buffer replaced[SECTION_IDS] = { { 0 } };
+	bool replace[SECTION_IDS] = { false };
+	Buffer names = { 0 };
+	if(ok && (flags & INSTRUMENT_CALLS)) {
+		ok = rewriteTypes(&rw, (types ? types : empty)->payload, (functions ? functions : empty)->payload, &replaced[1]);
+		appendImports(&rw, (imports ? imports : empty)->payload, &replaced[2]);
+		replace[1] = replace[2] = true;
+		for(int i = 0; i < sectionCount && ok; ++i) {
+			const Section* section = &sections[i];
+			Reader payload = section->payload;
+			if(section->id == 7)
+				ok = rewriteExports(&rw, payload, &replaced[7]);
+			else if(section->id == 8)
+				putLeb(&replaced[8], shiftFunction(&rw, readLeb(&payload)));
+			else if(section->id == 9)
+				ok = rewriteElements(&rw, payload, &replaced[9]);
+			else if(isNameSection(section))
+				ok = rewriteNames(&rw, payload, &names);
+			replace[section->id] |= section->id >= 7 && section->id <= 9;
+		}
+	}
+	const Section* code = findSection(sections, sectionCount, 10);
+	if(ok && code && (flags & (INSTRUMENT_BLOCKS | INSTRUMENT_CALLS))) {
+		ok = rewriteCode(&rw, code->payload, &replaced[10]);
+		replace[10] = true;
+	}
+	if(ok && info->blockCount > 0) {
+		// the counters start at zero
+		Reader old = (globals ? globals : empty)->payload;
+		uint32_t count = readLeb(&old);
+		putLeb(&replaced[6], count + info->blockCount);
+		if(globals)
+			putBytes(&replaced[6], old.p, (size_t)(old.end - old.p));
+		for(uint32_t block = 0; block < info->blockCount; ++block)
+			putBytes(&replaced[6], "\x7e\x01\x42\x00\x0b", 5);
+		replace[6] = true;
+	}
+
+	// sections the module lacks go before the first one that follows them
+	Buffer out = { 0 };
+	putBytes(&out, wasm, 8);
+	bool written[SECTION_IDS] = { false };
+	for(int i = 0; i <= sectionCount && ok; ++i) {
+		const Section* section = i < sectionCount ? &sections[i] : NULL;
+		for(uint8_t id = 1; id < SECTION_IDS && (section == NULL || section->id != 0); ++id) {
+			if(replace[id] && !written[id] && !findSection(sections, sectionCount, id)
+					&& (section == NULL || sectionOrder(id) < sectionOrder(section->id))) {
+				putSection(&out, id, replaced[id].data, replaced[id].size);
+				written[id] = true;
+			}
+		}
+		if(section == NULL)
+			break;
+		const uint8_t* payload = section->payload.p;
+		size_t payloadSize = (size_t)(section->payload.end - payload);
+		if(section->id != 0 && replace[section->id]) {
+			putSection(&out, section->id, replaced[section->id].data, replaced[section->id].size);
+			written[section->id] = true;
+		} else if((flags & INSTRUMENT_CALLS) && isNameSection(section)) {
+			putSection(&out, 0, names.data, names.size);
+		} else {
+			putSection(&out, section->id, payload, payloadSize);
+		}
+	}
+	for(int id = 0; id < SECTION_IDS; ++id) {
+		ok = ok && !replaced[id].failed;
+		free(replaced[id].data);
+	}
+	ok = ok && !names.failed;
+	free(names.data);
+	free(rw.blockTypes);
+	if(!ok || out.failed) {
+		free(out.data);
+		instrumentationFree(info);
+		return NULL;
+	}
+	*sizeOut = (uint32_t)out.size;
+	return out.data;
+}
+
+void
+instrumentationFree(Instrumentation* info)
+{
+	free(info->pairs);
+	memset(info, 0, sizeof(*info));
+}
+
+static char*
+copyName(Reader* in)
+{
+	uint32_t length = readLeb(in);
+	const uint8_t* start = in->p;
+	skipBytes(in, length);
+	char* name = in->failed ? NULL : malloc(length + 1);
+	if(name) {
+		memcpy(name, start, length);
+		name[length] = 0;
+	}
+	return name;
+}
+
+char**
+instrumentFunctionNames(const uint8_t* wasm, uint32_t size, uint32_t* count)
+{
+	Section sections[MAX_SECTIONS];
+	int sectionCount = readSections(wasm, size, sections);
+	if(sectionCount < 0)
+		return NULL;
+	const Section* imports = findSection(sections, sectionCount, 2);
+	const Section* functions = findSection(sections, sectionCount, 3);
+	uint32_t functionImports = imports ? countImports(imports->payload, 0) : 0;
+	Reader defined = functions ? functions->payload : (Reader){ (const uint8_t*)"", (const uint8_t*)"" + 1, false };
+	uint32_t functionCount = functionImports + readLeb(&defined);
+	if(functionImports == UINT32_MAX || functionCount < functionImports || functionCount > (1u << 24))
+		return NULL;
+	char** names = calloc(functionCount + 1, sizeof(char*));
+	if(names == NULL)
+		return NULL;
+
+	// imports are named by their field
+	Reader in = imports ? imports->payload : defined;
+	uint32_t function = 0;
+	for(uint32_t n = imports ? readLeb(&in) : 0; n > 0 && !in.failed; --n) {
+		Reader field = in;
+		skipBytes(&field, readLeb(&field));
+		if(skipImport(&in) == 0 && !in.failed)
+			names[function++] = copyName(&field);
+	}
+
+	for(int i = 0; i < sectionCount; ++i) {
+		if(!isNameSection(&sections[i]))
+			continue;
+		in = sections[i].payload;
+		skipBytes(&in, readLeb(&in));
+		while(in.p < in.end && !in.failed) {
+			uint8_t id = readByte(&in);
+			uint32_t subSize = readLeb(&in);
+			if(in.failed || subSize > (size_t)(in.end - in.p))
+				break;
+			Reader sub = { in.p, in.p + subSize, false };
+			in.p += subSize;
+			if(id != 1)
+				continue;
+			for(uint32_t n = readLeb(&sub); n > 0 && !sub.failed; --n) {
+				uint32_t index = readLeb(&sub);
+				char* name = copyName(&sub);
+				if(name && index < functionCount) {
+					free(names[index]);
+					names[index] = name;
+				} else {
+					free(name);
+				}
+			}
+		}
+	}
+	*count = functionCount;
+	return names;
+}
+
+void
+instrumentFreeNames(char** names, uint32_t count)
+{
+	if(names == NULL)
+		return;
+	for(uint32_t i = 0; i < count; ++i)
+		free(names[i]);
+	free(names);
+}
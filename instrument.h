@@ -0,0 +1,53 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewrites cart modules for the profiling builds, before wasm3 sees them.
+// Opcodes are numbered by their byte, 0xfc-prefixed ones as 256 + their
+// second byte.
+#define INSTRUMENT_OPS (256 + 18)
+
+// INSTRUMENT_BLOCKS gives every straight-line run of instructions an i64
+// counter global, appended after the cart's own globals and incremented
+// when the run starts. Since all instructions of a run execute equally
+// often, the counters give the executions of each adjacent opcode pair
+// within a run.
+#define INSTRUMENT_BLOCKS 1
+
+// INSTRUMENT_CALLS makes every cart function call the imports
+// uw8profile.enter (i32 function) and uw8profile.leave () around its body,
+// with the function's index in the original module. The imports come
+// after the cart's own, so the cart's functions move up by two.
+#define INSTRUMENT_CALLS 2
+
+typedef struct OpPair {
+	uint32_t block;
+	uint16_t first;
+	uint16_t second;
+} OpPair;
+
+typedef struct Instrumentation {
+	unsigned flags;
+	uint32_t firstCounter; // global index of block 0's counter
+	uint32_t blockCount;
+	OpPair* pairs;
+	uint32_t pairCount;
+} Instrumentation;
+
+// The instrumented module is malloc'ed, NULL if the module is malformed or
+// uses instructions this does not know.
+uint8_t* instrumentModule(const uint8_t* wasm, uint32_t size, unsigned flags, Instrumentation* info, uint32_t* sizeOut);
+void instrumentationFree(Instrumentation* info);
+
+// The names of the module's functions by index, from the name section or
+// else the import's field, NULL where there is neither. Freed with
+// instrumentFreeNames.
+char** instrumentFunctionNames(const uint8_t* wasm, uint32_t size, uint32_t* count);
+void instrumentFreeNames(char** names, uint32_t count);
+
+// "i32.add" etc.
+const char* instrumentOpName(uint16_t op);
+
+#endif
@@ -4,7 +4,7 @@ CORE_DIR := $(LOCAL_PATH)/..
 
 include $(LOCAL_PATH)/../Makefile.common
 
-COREFLAGS := $(COREDEFINES) $(INCFLAGS)
+COREFLAGS := $(COREDEFINES) $(INCFLAGS) -DHAVE_THREADS
 
 GIT_VERSION := " $(shell git rev-parse --short HEAD || echo unknown)"
 ifneq ($(GIT_VERSION)," unknown")
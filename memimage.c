@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <m3_env.h>
+
+#include "memimage.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(SYS_memfd_create)
+#define HAVE_MEMFD 1
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+#endif
+
+#ifdef HAVE_MEMFD
+
+static bool
+isZeroPage(const uint8_t* page, size_t size)
+{
+	for(size_t i = 0; i < size; ++i)
+		if(page[i] != 0)
+			return false;
+	return true;
+}
+
+bool
+memImageInit(MemImage* image, const uint8_t* data, size_t size)
+{
+	image->size = size;
+	image->copy = NULL;
+	image->view = NULL;
+	image->fd = (int)syscall(SYS_memfd_create, "uw8-image", MFD_CLOEXEC);
+	if(image->fd >= 0) {
+		// all-zero pages are left as holes, they take no memory
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		bool ok = ftruncate(image->fd, (off_t)size) == 0 && size % pageSize == 0;
+		for(size_t offset = 0; ok && offset < size; offset += pageSize)
+			if(!isZeroPage(data + offset, pageSize))
+				ok = pwrite(image->fd, data + offset, pageSize, (off_t)offset) == (ssize_t)pageSize;
+		if(ok)
+			return true;
+		close(image->fd);
+		image->fd = -1;
+	}
+
+	image->copy = malloc(size);
+	if(image->copy == NULL)
+		return false;
+	memcpy(image->copy, data, size);
+	return true;
+}
+
+void
+memImageFree(MemImage* image)
+{
+	if(image->view)
+		munmap(image->view, image->size);
+	image->view = NULL;
+	if(image->fd >= 0)
+		close(image->fd);
+	image->fd = -1;
+	free(image->copy);
+	image->copy = NULL;
+}
+
+// wasm3 expects the memory header directly in front of the data, so the
+// mapping starts with one anonymous page holding the header at its end.
+bool
+memImageAttach(MemImage* image, IM3Runtime runtime)
+{
+	if(image->fd < 0)
+		return false;
+
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	uint8_t* region = mmap(NULL, pageSize + image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(region == MAP_FAILED)
+		return false;
+	if(mmap(region + pageSize, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, 0) == MAP_FAILED) {
+		munmap(region, pageSize + image->size);
+		return false;
+	}
+
+	M3MemoryHeader* header = (M3MemoryHeader*)(region + pageSize) - 1;
+	memcpy(header, runtime->memory.mallocated, sizeof(M3MemoryHeader));
+	m3_Free(runtime->memory.mallocated);
+	runtime->memory.mallocated = header;
+	return true;
+}
+
+void
+memImageDetach(MemImage* image, IM3Runtime runtime)
+{
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	uint8_t* data = (uint8_t*)(runtime->memory.mallocated + 1);
+	munmap(data - pageSize, pageSize + image->size);
+	runtime->memory.mallocated = NULL;
+}
+
+const uint8_t*
+memImageContents(MemImage* image)
+{
+	if(image->fd < 0)
+		return image->copy;
+	if(image->view == NULL) {
+		void* view = mmap(NULL, image->size, PROT_READ, MAP_SHARED, image->fd, 0);
+		if(view == MAP_FAILED)
+			return NULL;
+		image->view = view;
+	}
+	return image->view;
+}
+
+void
+memImageRestore(MemImage* image, uint8_t* memory, bool attached)
+{
+	// dropping the private pages makes them fault in from the image again
+	if(attached && madvise(memory, image->size, MADV_DONTNEED) == 0)
+		return;
+	if(image->fd >= 0)
+		pread(image->fd, memory, image->size, 0);
+	else
+		memcpy(memory, image->copy, image->size);
+}
+
+#else
+
+bool
+memImageInit(MemImage* image, const uint8_t* data, size_t size)
+{
+	image->size = size;
+	image->fd = -1;
+	image->view = NULL;
+	image->copy = malloc(size);
+	if(image->copy == NULL)
+		return false;
+	memcpy(image->copy, data, size);
+	return true;
+}
+
+void
+memImageFree(MemImage* image)
+{
+	free(image->copy);
+	image->copy = NULL;
+}
+
+bool
+memImageAttach(MemImage* image, IM3Runtime runtime)
+{
+	return false;
+}
+
+void
+memImageDetach(MemImage* image, IM3Runtime runtime)
+{
+}
+
+const uint8_t*
+memImageContents(MemImage* image)
+{
+	return image->copy;
+}
+
+void
+memImageRestore(MemImage* image, uint8_t* memory, bool attached)
+{
+	memcpy(memory, image->copy, image->size);
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef MEMIMAGE_H
+#define MEMIMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wasm3.h>
+
+// Snapshot of a guest memory right after the cart's start function ran.
+// Where the OS supports it the image lives in an anonymous memfd and guest
+// memories are private copy-on-write mappings of it, so restoring a memory
+// only drops the pages the cart has written to. Elsewhere the image is a
+// plain heap copy.
+typedef struct MemImage {
+	size_t size;
+	int fd; // -1 when the image is held in copy
+	uint8_t* copy;
+	uint8_t* view; // read-only mapping of the memfd, made on first use
+} MemImage;
+
+bool memImageInit(MemImage* image, const uint8_t* data, size_t size);
+void memImageFree(MemImage* image);
+
+// Replaces the linear memory of the runtime by a copy-on-write mapping of
+// the image. Returns false (leaving the runtime untouched) if mappings are
+// not supported.
+bool memImageAttach(MemImage* image, IM3Runtime runtime);
+// Has to be called before m3_FreeRuntime on an attached runtime.
+void memImageDetach(MemImage* image, IM3Runtime runtime);
+
+// The image contents, for comparing memories against. NULL if the image
+// cannot be mapped.
+const uint8_t* memImageContents(MemImage* image);
+
+// Resets memory to the contents of the image. attached selects the cheap
+// path for memories previously mapped with memImageAttach.
+void memImageRestore(MemImage* image, uint8_t* memory, bool attached);
+
+#endif
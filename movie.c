@@ -0,0 +1,280 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "movie.h"
+
+#define MOVIE_MAGIC "UW8M"
+#define MOVIE_FORMAT 3
+
+// File layout: header, frameCount * 4 input bytes, keyframeCount index
+// entries (frame, size, offset), then the keyframes' saved states. The
+// header and the index are written field by field, little-endian.
+#define MOVIE_HEADER_SIZE (4 + 4 + 8 + 8 + 4 + 4 + 4 + 4)
+#define KEYFRAME_ENTRY_SIZE (4 + 4 + 8)
+
+typedef struct MovieHeader {
+	char magic[4];
+	uint32_t format;
+	uint64_t cartHash;
+	uint64_t randomSeed;
+	uint32_t frameCount;
+	uint32_t keyframeInterval;
+	uint32_t keyframeCount;
+	uint32_t reserved;
+} MovieHeader;
+
+typedef struct Keyframe {
+	uint32_t frame;
+	uint32_t size;
+	uint8_t* data; // written by uw8StateWrite
+} Keyframe;
+
+struct Movie {
+	MovieHeader header;
+	uint8_t* inputs;
+	uint32_t inputCapacity; // in frames
+	Keyframe* keyframes;
+	uint32_t keyframeCapacity;
+	uint32_t position;
+};
+
+static void
+writeHeader(uint8_t* out, const MovieHeader* header)
+{
+	memcpy(out, header->magic, 4);
+	out = putLe(out + 4, header->format, 4);
+	out = putLe(out, header->cartHash, 8);
+	out = putLe(out, header->randomSeed, 8);
+	out = putLe(out, header->frameCount, 4);
+	out = putLe(out, header->keyframeInterval, 4);
+	out = putLe(out, header->keyframeCount, 4);
+	putLe(out, header->reserved, 4);
+}
+
+static void
+readHeader(const uint8_t* in, MovieHeader* header)
+{
+	memcpy(header->magic, in, 4);
+	header->format = (uint32_t)getLe(in + 4, 4);
+	header->cartHash = getLe(in + 8, 8);
+	header->randomSeed = getLe(in + 16, 8);
+	header->frameCount = (uint32_t)getLe(in + 24, 4);
+	header->keyframeInterval = (uint32_t)getLe(in + 28, 4);
+	header->keyframeCount = (uint32_t)getLe(in + 32, 4);
+	header->reserved = (uint32_t)getLe(in + 36, 4);
+}
+
+static bool
+addKeyframe(Movie* movie, Uw8Core* core)
+{
+	if(movie->header.keyframeCount == movie->keyframeCapacity) {
+		uint32_t capacity = movie->keyframeCapacity ? movie->keyframeCapacity * 2 : 16;
+		Keyframe* keyframes = realloc(movie->keyframes, capacity * sizeof(Keyframe));
+		if(keyframes == NULL)
+			return false;
+		movie->keyframes = keyframes;
+		movie->keyframeCapacity = capacity;
+	}
+	Uw8State* state = uw8StateSave(core);
+	if(state == NULL)
+		return false;
+	Keyframe* keyframe = &movie->keyframes[movie->header.keyframeCount];
+	keyframe->frame = movie->header.frameCount;
+	keyframe->size = (uint32_t)uw8StateSize(state);
+	keyframe->data = malloc(keyframe->size);
+	if(keyframe->data)
+		uw8StateWrite(state, keyframe->data);
+	uw8StateFree(state);
+	if(keyframe->data == NULL)
+		return false;
+	++movie->header.keyframeCount;
+	return true;
+}
+
+Movie*
+movieStartRecording(Uw8Core* core, uint64_t cartHash, uint32_t keyframeInterval)
+{
+	Movie* movie = calloc(1, sizeof(Movie));
+	if(movie == NULL)
+		return NULL;
+	memcpy(movie->header.magic, MOVIE_MAGIC, 4);
+	movie->header.format = MOVIE_FORMAT;
+	movie->header.cartHash = cartHash;
+	movie->header.randomSeed = uw8RandomState(core);
+	movie->header.keyframeInterval = keyframeInterval ? keyframeInterval : 1;
+	if(!addKeyframe(movie, core)) {
+		movieFree(movie);
+		return NULL;
+	}
+	return movie;
+}
+
+bool
+movieRecordFrame(Movie* movie, Uw8Core* core, const uint8_t buttons[4])
+{
+	MovieHeader* header = &movie->header;
+	if(header->frameCount > 0 && header->frameCount % header->keyframeInterval == 0)
+		if(!addKeyframe(movie, core))
+			return false;
+	if(header->frameCount == movie->inputCapacity) {
+		uint32_t capacity = movie->inputCapacity ? movie->inputCapacity * 2 : 3600;
+		uint8_t* inputs = realloc(movie->inputs, (size_t)capacity * 4);
+		if(inputs == NULL)
+			return false;
+		movie->inputs = inputs;
+		movie->inputCapacity = capacity;
+	}
+	memcpy(movie->inputs + (size_t)header->frameCount * 4, buttons, 4);
+	++header->frameCount;
+	movie->position = header->frameCount;
+	return true;
+}
+
+bool
+movieSave(Movie* movie, const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if(file == NULL)
+		return false;
+	MovieHeader* header = &movie->header;
+	uint8_t bytes[MOVIE_HEADER_SIZE];
+	writeHeader(bytes, header);
+	bool ok = fwrite(bytes, MOVIE_HEADER_SIZE, 1, file) == 1
+		&& fwrite(movie->inputs, 4, header->frameCount, file) == header->frameCount;
+
+	uint64_t offset = MOVIE_HEADER_SIZE + (uint64_t)header->frameCount * 4 + (uint64_t)header->keyframeCount * KEYFRAME_ENTRY_SIZE;
+	for(uint32_t i = 0; ok && i < header->keyframeCount; ++i) {
+		uint8_t* out = putLe(bytes, movie->keyframes[i].frame, 4);
+		out = putLe(out, movie->keyframes[i].size, 4);
+		putLe(out, offset, 8);
+		ok = fwrite(bytes, KEYFRAME_ENTRY_SIZE, 1, file) == 1;
+		offset += movie->keyframes[i].size;
+	}
+	for(uint32_t i = 0; ok && i < header->keyframeCount; ++i)
+		ok = fwrite(movie->keyframes[i].data, 1, movie->keyframes[i].size, file) == movie->keyframes[i].size;
+	if(fclose(file) != 0 || !ok) {
+		remove(path);
+		return false;
+	}
+	return true;
+}
+
+// Keyframes are read back in file order, so the offsets only serve other
+// readers that want to load single keyframes.
+Movie*
+movieLoad(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+	Movie* movie = calloc(1, sizeof(Movie));
+	MovieHeader* header = movie ? &movie->header : NULL;
+	uint8_t bytes[MOVIE_HEADER_SIZE];
+	bool ok = movie != NULL && fread(bytes, MOVIE_HEADER_SIZE, 1, file) == 1;
+	if(ok)
+		readHeader(bytes, header);
+	ok = ok && memcmp(header->magic, MOVIE_MAGIC, 4) == 0
+		&& header->format == MOVIE_FORMAT
+		&& header->keyframeCount > 0;
+	if(ok) {
+		movie->inputs = malloc((size_t)header->frameCount * 4 + 1);
+		movie->keyframes = calloc(header->keyframeCount, sizeof(Keyframe));
+		ok = movie->inputs && movie->keyframes
+			&& fread(movie->inputs, 4, header->frameCount, file) == header->frameCount;
+		movie->inputCapacity = header->frameCount;
+		movie->keyframeCapacity = header->keyframeCount;
+	}
+	for(uint32_t i = 0; ok && i < header->keyframeCount; ++i) {
+		ok = fread(bytes, KEYFRAME_ENTRY_SIZE, 1, file) == 1;
+		uint32_t frame = (uint32_t)getLe(bytes, 4);
+		ok = ok && frame <= header->frameCount
+			&& (i == 0 ? frame == 0 : frame > movie->keyframes[i - 1].frame);
+		movie->keyframes[i].frame = frame;
+		movie->keyframes[i].size = (uint32_t)getLe(bytes + 4, 4);
+	}
+	for(uint32_t i = 0; ok && i < header->keyframeCount; ++i) {
+		Keyframe* keyframe = &movie->keyframes[i];
+		keyframe->data = malloc(keyframe->size);
+		ok = keyframe->data && fread(keyframe->data, 1, keyframe->size, file) == keyframe->size;
+	}
+	fclose(file);
+	if(!ok) {
+		movieFree(movie);
+		return NULL;
+	}
+	return movie;
+}
+
+uint64_t
+movieCartHash(Movie* movie)
+{
+	return movie->header.cartHash;
+}
+
+uint64_t
+movieRandomSeed(Movie* movie)
+{
+	return movie->header.randomSeed;
+}
+
+uint32_t
+movieFrameCount(Movie* movie)
+{
+	return movie->header.frameCount;
+}
+
+uint32_t
+moviePosition(Movie* movie)
+{
+	return movie->position;
+}
+
+bool
+movieSeek(Movie* movie, Uw8Core* core, uint32_t frame)
+{
+	if(frame > movie->header.frameCount)
+		return false;
+	uint32_t k = 0;
+	while(k + 1 < movie->header.keyframeCount && movie->keyframes[k + 1].frame <= frame)
+		++k;
+	Uw8State* state = uw8StateRead(movie->keyframes[k].data, movie->keyframes[k].size);
+	bool ok = state && uw8StateLoad(core, state);
+	uw8StateFree(state);
+	if(!ok)
+		return false;
+
+	// the sound has state of its own, so it is synthesized and dropped
+	int16_t samples[UW8_SAMPLES_PER_FRAME * 2];
+	for(uint32_t f = movie->keyframes[k].frame; f < frame; ++f) {
+		uw8RunFrame(core, movie->inputs + (size_t)f * 4);
+		uw8RenderAudio(core, samples);
+	}
+	movie->position = frame;
+	return true;
+}
+
+bool
+moviePlayFrame(Movie* movie, uint8_t buttons[4])
+{
+	if(movie->position >= movie->header.frameCount)
+		return false;
+	memcpy(buttons, movie->inputs + (size_t)movie->position * 4, 4);
+	++movie->position;
+	return true;
+}
+
+void
+movieFree(Movie* movie)
+{
+	if(movie == NULL)
+		return;
+	if(movie->keyframes)
+		for(uint32_t i = 0; i < movie->header.keyframeCount; ++i)
+			free(movie->keyframes[i].data);
+	free(movie->keyframes);
+	free(movie->inputs);
+	free(movie);
+}
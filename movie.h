@@ -0,0 +1,33 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uw8.h"
+
+// Input movies: the four gamepad bytes of every frame plus a saved state
+// every keyframe interval, starting with the state the recording began in.
+// Playback can seek to any frame by loading the keyframe before it and
+// simulating the remaining frames.
+typedef struct Movie Movie;
+
+Movie* movieStartRecording(Uw8Core* core, uint64_t cartHash, uint32_t keyframeInterval);
+// Call with the buttons of each frame, before it runs.
+bool movieRecordFrame(Movie* movie, Uw8Core* core, const uint8_t buttons[4]);
+bool movieSave(Movie* movie, const char* path);
+
+Movie* movieLoad(const char* path);
+uint64_t movieCartHash(Movie* movie);
+uint64_t movieRandomSeed(Movie* movie); // the RNG state the recording began with
+uint32_t movieFrameCount(Movie* movie);
+uint32_t moviePosition(Movie* movie);
+// Puts core into the state right before the given frame, simulating from
+// the closest keyframe as fast as possible.
+bool movieSeek(Movie* movie, Uw8Core* core, uint32_t frame);
+// The buttons of the next frame. False at the end of the movie.
+bool moviePlayFrame(Movie* movie, uint8_t buttons[4]);
+
+void movieFree(Movie* movie);
+
+#endif
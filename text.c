@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "text.h"
+
+#define FRAMEBUFFER 120
+#define CONTROL_ARGS 0x12d20
+#define INT_BUFFER 0x12fff
+#define FONT 0x13400
+
+static const uint64_t*
+glyphRows(GlyphCache* cache, const uint8_t* memory, uint32_t c)
+{
+	const uint8_t* source = memory + FONT + c * 8;
+	if(!cache->valid[c] || memcmp(cache->source[c], source, 8) != 0) {
+		memcpy(cache->source[c], source, 8);
+		for(int y = 0; y < 8; ++y) {
+			uint8_t row[8];
+			for(int x = 0; x < 8; ++x)
+				row[x] = (source[y] << x) & 0x80 ? 0xff : 0;
+			memcpy(&cache->rows[c][y], row, 8);
+		}
+		cache->valid[c] = true;
+	}
+	return cache->rows[c];
+}
+
+// Draws c at the cursor and advances it, like the platform's f35 in text
+// (0) and transparent graphics (1) mode.
+static void
+drawGlyph(Z_platform_instance_t* platform, GlyphCache* cache, uint32_t c)
+{
+	if(platform->w2c_g5 == 0 && (int32_t)platform->w2c_g1 >= 320)
+		Z_platformZ_printChar(platform, 0x0d0a); // wrap with "\n\r"
+
+	uint8_t* memory = platform->Z_envZ_memory->data;
+	const uint64_t* rows = glyphRows(cache, memory, c);
+	uint32_t x0 = platform->w2c_g1;
+	uint32_t y0 = platform->w2c_g2;
+	uint8_t fgColor = (uint8_t)platform->w2c_g3;
+	uint8_t bgColor = (uint8_t)platform->w2c_g4;
+	uint64_t fg = 0x0101010101010101ull * fgColor;
+	uint64_t bg = 0x0101010101010101ull * bgColor;
+	bool transparent = platform->w2c_g5 != 0;
+
+	for(uint32_t y = 0; y < 8; ++y) {
+		uint32_t py = y0 + y;
+		if(py >= 240)
+			continue;
+		uint8_t* line = memory + FRAMEBUFFER + py * 320;
+		if(x0 <= 320 - 8) {
+			uint64_t pixels;
+			if(transparent) {
+				memcpy(&pixels, line + x0, 8);
+				pixels = (pixels & ~rows[y]) | (fg & rows[y]);
+			} else
+				pixels = (fg & rows[y]) | (bg & ~rows[y]);
+			memcpy(line + x0, &pixels, 8);
+		} else {
+			// clipped at the screen edge, coordinates wrap like u32 in wasm
+			const uint8_t* mask = (const uint8_t*)&rows[y];
+			for(uint32_t x = 0; x < 8; ++x) {
+				uint32_t px = x0 + x;
+				if(px >= 320)
+					continue;
+				if(mask[x])
+					line[px] = fgColor;
+				else if(!transparent)
+					line[px] = bgColor;
+			}
+		}
+	}
+	platform->w2c_g1 += 8;
+}
+
+static void
+printByte(Z_platform_instance_t* platform, GlyphCache* cache, uint32_t c)
+{
+	// control codes, their pending arguments and console output (g5 >= 2)
+	// keep going through the original state machine
+	if(platform->w2c_g6 != 0 || c < 32 || (int32_t)platform->w2c_g5 >= 2) {
+		Z_platformZ_printChar(platform, c);
+		return;
+	}
+	platform->Z_envZ_memory->data[CONTROL_ARGS] = (uint8_t)c;
+	drawGlyph(platform, cache, c);
+}
+
+void
+textPrintChar(Z_platform_instance_t* platform, GlyphCache* cache, uint32_t c)
+{
+	do {
+		printByte(platform, cache, c & 255);
+		c >>= 8;
+	} while(c);
+}
+
+void
+textPrintString(Z_platform_instance_t* platform, GlyphCache* cache, uint32_t address)
+{
+	const wasm_rt_memory_t* memory = platform->Z_envZ_memory;
+	for(; address < memory->size; ++address) {
+		uint8_t c = memory->data[address];
+		if(c == 0)
+			return;
+		printByte(platform, cache, c);
+	}
+	// let the original trap on the out of bounds access
+	Z_platformZ_printString(platform, address);
+}
+
+void
+textPrintInt(Z_platform_instance_t* platform, GlyphCache* cache, int32_t value)
+{
+	// the digits are formatted into guest memory, as the original does
+	uint8_t* memory = platform->Z_envZ_memory->data;
+	uint32_t address = INT_BUFFER;
+	memory[address] = 0;
+	uint32_t n = (uint32_t)value;
+	if(value < 0) {
+		printByte(platform, cache, '-');
+		n = 0u - n;
+	}
+	do {
+		memory[--address] = '0' + n % 10;
+		n /= 10;
+	} while(n);
+	textPrintString(platform, cache, address);
+}
@@ -0,0 +1,24 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "platform.h"
+
+// The font is read from guest memory on every print, as carts may replace
+// it. Each glyph is expanded into one byte mask per pixel the first time it
+// is drawn and re-expanded whenever its font bytes have changed.
+typedef struct GlyphCache {
+	bool valid[256];
+	uint8_t source[256][8];
+	uint64_t rows[256][8];
+} GlyphCache;
+
+// Native versions of the platform's print functions. Plain characters are
+// drawn here, control codes are handed to the wasm2c implementation.
+void textPrintChar(Z_platform_instance_t* platform, GlyphCache* cache, uint32_t c);
+void textPrintString(Z_platform_instance_t* platform, GlyphCache* cache, uint32_t address);
+void textPrintInt(Z_platform_instance_t* platform, GlyphCache* cache, int32_t value);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Monotonic time in microseconds, for load and frame statistics.
+static inline uint64_t
+timeMicros(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)(counter.QuadPart * 1000000 / frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+// Monotonic time in nanoseconds, for profiling short calls.
+static inline uint64_t
+timeNanos(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000
+		+ counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#endif
@@ -0,0 +1,67 @@
+// Compares verification hash logs written with the uw8_hash_log option,
+// either two logs or two directories of logs for the same cart corpus
+// (e.g. one per build), and reports the first frame where they differ.
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "hashlog.h"
+
+static int
+compareLogs(const char* a, const char* b, const char* name)
+{
+	uint32_t frame;
+	const char* what;
+	switch(hashLogCompare(a, b, &frame, &what)) {
+	case HASHLOG_EQUAL:
+		return 0;
+	case HASHLOG_DIFFERENT:
+		printf("%s: first difference at frame %u (%s)\n", name, frame, what);
+		return 1;
+	case HASHLOG_LENGTH:
+		printf("%s: equal up to frame %u, where one log ends\n", name, frame);
+		return 1;
+	default:
+		printf("%s: could not read the logs\n", name);
+		return 1;
+	}
+}
+
+static int
+compareDirs(const char* dirA, const char* dirB)
+{
+	DIR* dir = opendir(dirA);
+	if(dir == NULL) {
+		perror(dirA);
+		return 2;
+	}
+	int differences = 0, logs = 0;
+	struct dirent* entry;
+	while((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		if(length < 8 || strcmp(entry->d_name + length - 8, ".hashlog") != 0)
+			continue;
+		char a[1024], b[1024];
+		snprintf(a, sizeof(a), "%s/%s", dirA, entry->d_name);
+		snprintf(b, sizeof(b), "%s/%s", dirB, entry->d_name);
+		differences += compareLogs(a, b, entry->d_name);
+		++logs;
+	}
+	closedir(dir);
+	printf("%d of %d logs differ\n", differences, logs);
+	return differences ? 1 : 0;
+}
+
+int
+main(int argc, char** argv)
+{
+	if(argc != 3) {
+		fprintf(stderr, "usage: %s <log or dir> <log or dir>\n", argv[0]);
+		return 2;
+	}
+	struct stat info;
+	if(stat(argv[1], &info) == 0 && S_ISDIR(info.st_mode))
+		return compareDirs(argv[1], argv[2]);
+	return compareLogs(argv[1], argv[2], argv[1]);
+}
@@ -0,0 +1,188 @@
+// Checks that cores running at the same time do not affect each other:
+// runs each cart on several instances in parallel, one thread each, then
+// on the same instances one after the other, and compares the per-frame
+// hashes of both runs. Every instance plays its own input sequence so
+// that they do not all take the same path through the cart.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashlog.h"
+#include "uw8.h"
+#include "worker.h"
+
+#define DEFAULT_INSTANCES 8
+#define DEFAULT_FRAMES 600
+
+typedef struct Run {
+	const uint8_t* cart;
+	size_t cartSize;
+	uint32_t seed;
+	uint32_t frames;
+	FrameHashes* hashes; // one per frame
+	bool ok;
+} Run;
+
+// Loads the cart into a fresh instance and plays it, like retro_run does.
+static void
+runInstance(void* arg)
+{
+	Run* run = arg;
+	Uw8Core* core = uw8Create();
+	run->ok = core != NULL && uw8Load(core, run->cart, run->cartSize, false);
+	uint32_t random = (run->seed + 1) * 2654435761u;
+	uint8_t buttons[4] = { 0 };
+	int16_t samples[UW8_SAMPLES_PER_FRAME * 2];
+	for(uint32_t frame = 0; run->ok && frame < run->frames; ++frame) {
+		// all four gamepads, held for 8 frames at a time
+		if(frame % 8 == 0) {
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			for(int i = 0; i < 4; ++i)
+				buttons[i] = (uint8_t)(random >> (8 * i));
+		}
+		uw8RunFrame(core, buttons);
+		uw8RenderAudio(core, samples);
+		const uint8_t* memory = uw8Memory(core);
+		FrameHashes* hashes = &run->hashes[frame];
+		hashes->framebuffer = hashLogHash(memory + UW8_FRAMEBUFFER, 320 * 240);
+		hashes->palette = hashLogHash(memory + UW8_PALETTE, 256 * 4);
+		hashes->audio = hashLogHash(samples, sizeof(samples));
+	}
+	uw8Destroy(core);
+}
+
+static uint8_t*
+readFile(const char* path, size_t* size)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+	uint8_t* data = NULL;
+	long length;
+	if(fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+		data = malloc(length);
+		if(data && fread(data, 1, length, file) != (size_t)length) {
+			free(data);
+			data = NULL;
+		}
+		*size = length;
+	}
+	fclose(file);
+	return data;
+}
+
+static const char*
+difference(const FrameHashes* a, const FrameHashes* b)
+{
+	if(a->framebuffer != b->framebuffer)
+		return "framebuffer";
+	if(a->palette != b->palette)
+		return "palette";
+	if(a->audio != b->audio)
+		return "audio";
+	return NULL;
+}
+
+// Returns the number of instances whose runs differ, or -1 on errors.
+static int
+checkCart(const char* path, uint32_t instances, uint32_t frames)
+{
+	size_t cartSize = 0;
+	uint8_t* cart = readFile(path, &cartSize);
+	Run* runs = calloc(instances * 2, sizeof(Run));
+	FrameHashes* hashes = calloc((size_t)instances * 2 * frames + 1, sizeof(FrameHashes));
+	Worker** workers = calloc(instances, sizeof(Worker*));
+	int result = -1;
+	if(cart == NULL || runs == NULL || hashes == NULL || workers == NULL) {
+		fprintf(stderr, "%s: could not read the cart\n", path);
+		goto done;
+	}
+	for(uint32_t i = 0; i < instances * 2; ++i) {
+		runs[i].cart = cart;
+		runs[i].cartSize = cartSize;
+		runs[i].seed = i % instances;
+		runs[i].frames = frames;
+		runs[i].hashes = hashes + (size_t)i * frames;
+	}
+
+	// runs[0, instances) in parallel, runs[instances, 2 * instances) serially
+	uint32_t started = 0;
+	while(started < instances && (workers[started] = workerCreate()) != NULL)
+		++started;
+	if(started < instances)
+		fprintf(stderr, "%s: only %u threads\n", path, started);
+	for(uint32_t i = 0; i < started; ++i)
+		workerStart(workers[i], runInstance, &runs[i]);
+	for(uint32_t i = started; i < instances; ++i)
+		runInstance(&runs[i]);
+	for(uint32_t i = 0; i < started; ++i)
+		workerWait(workers[i]);
+	for(uint32_t i = instances; i < instances * 2; ++i)
+		runInstance(&runs[i]);
+
+	result = 0;
+	for(uint32_t i = 0; i < instances; ++i) {
+		const Run* parallel = &runs[i];
+		const Run* serial = &runs[instances + i];
+		if(!parallel->ok || !serial->ok) {
+			printf("%s: instance %u failed to load (%s)\n", path, i, parallel->ok ? "serial" : "parallel");
+			++result;
+			continue;
+		}
+		for(uint32_t frame = 0; frame < frames; ++frame) {
+			const char* what = difference(&parallel->hashes[frame], &serial->hashes[frame]);
+			if(what) {
+				printf("%s: instance %u differs from the serial run at frame %u (%s)\n", path, i, frame, what);
+				++result;
+				break;
+			}
+		}
+	}
+	if(result == 0)
+		printf("%s: %u instances equal for %u frames\n", path, instances, frames);
+	for(uint32_t i = 0; i < started; ++i)
+		workerDestroy(workers[i]);
+done:
+	free(workers);
+	free(hashes);
+	free(runs);
+	free(cart);
+	return result;
+}
+
+int
+main(int argc, char** argv)
+{
+	uint32_t instances = DEFAULT_INSTANCES;
+	uint32_t frames = DEFAULT_FRAMES;
+	int first = 1;
+	for(; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+		if(strcmp(argv[first], "-n") == 0)
+			instances = (uint32_t)strtoul(argv[first + 1], NULL, 10);
+		else if(strcmp(argv[first], "-f") == 0)
+			frames = (uint32_t)strtoul(argv[first + 1], NULL, 10);
+		else
+			break;
+	}
+	if(first >= argc || instances == 0 || frames == 0) {
+		fprintf(stderr, "usage: %s [-n instances] [-f frames] cart...\n"
+			"runs every cart on %u instances in parallel and serially, for %u frames by default\n",
+			argv[0], DEFAULT_INSTANCES, DEFAULT_FRAMES);
+		return 2;
+	}
+#ifndef HAVE_THREADS
+	fprintf(stderr, "built without HAVE_THREADS, the parallel run is serial too\n");
+#endif
+	int status = 0;
+	for(int i = first; i < argc; ++i) {
+		int result = checkCart(argv[i], instances, frames);
+		if(result < 0 && status == 0)
+			status = 2;
+		else if(result > 0)
+			status = 1;
+	}
+	return status;
+}
@@ -0,0 +1,154 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+#include "timing.h"
+#include "worker.h"
+
+// per thread and buffer; at most a few dozen events are recorded per frame
+#define TRACE_CAPACITY 8192
+
+typedef struct TraceRecord {
+	uint64_t nanos;
+	uint32_t value;
+	uint8_t name;
+	char phase;
+} TraceRecord;
+
+typedef struct TraceBuffer {
+	TraceRecord* records;
+	uint32_t count;
+	uint32_t dropped;
+} TraceBuffer;
+
+// Two buffers per thread: the threads record into buffers[current] while
+// the writer empties the other one.
+struct Trace {
+	FILE* file;
+	uint64_t start;
+	TraceBuffer buffers[2][TRACE_THREADS];
+	int current;
+	Worker* writer; // NULL writes on the calling thread
+	uint32_t dropped;
+};
+
+static const char* const traceNames[TRACE_NAMES] = {
+	"retro_run", "input", "upd", "resolve", "video_cb", "snd", "audio_cb",
+	"import calls", "import us",
+};
+
+static const char* const threadNames[TRACE_THREADS] = { "main", "video worker" };
+
+void
+traceEvent(Trace* trace, TraceThread thread, TraceName name, char phase, uint32_t value)
+{
+	TraceBuffer* buffer = &trace->buffers[trace->current][thread];
+	if(buffer->count == TRACE_CAPACITY) {
+		++buffer->dropped;
+		return;
+	}
+	TraceRecord* record = &buffer->records[buffer->count++];
+	record->nanos = timeNanos();
+	record->value = value;
+	record->name = (uint8_t)name;
+	record->phase = phase;
+}
+
+// Every event is written with a leading comma, as the metadata written by
+// traceOpen comes first.
+static void
+writeBuffers(void* arg)
+{
+	Trace* trace = arg;
+	TraceBuffer* buffers = trace->buffers[trace->current ^ 1];
+	for(int t = 0; t < TRACE_THREADS; ++t) {
+		TraceBuffer* buffer = &buffers[t];
+		for(uint32_t i = 0; i < buffer->count; ++i) {
+			const TraceRecord* record = &buffer->records[i];
+			double micros = (record->nanos - trace->start) / 1000.0;
+			if(record->phase == 'C')
+				fprintf(trace->file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"value\":%u}}",
+					traceNames[record->name], micros, t + 1, record->value);
+			else
+				fprintf(trace->file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+					traceNames[record->name], record->phase, micros, t + 1);
+		}
+		trace->dropped += buffer->dropped;
+		buffer->count = 0;
+		buffer->dropped = 0;
+	}
+	fflush(trace->file);
+}
+
+static void
+flush(Trace* trace)
+{
+	if(trace->writer)
+		workerWait(trace->writer);
+	trace->current ^= 1;
+	if(trace->writer)
+		workerStart(trace->writer, writeBuffers, trace);
+	else
+		writeBuffers(trace);
+}
+
+Trace*
+traceOpen(const char* path)
+{
+	Trace* trace = calloc(1, sizeof(Trace));
+	if(trace == NULL)
+		return NULL;
+	bool ok = true;
+	for(int b = 0; b < 2; ++b)
+		for(int t = 0; t < TRACE_THREADS; ++t)
+			ok = ok && (trace->buffers[b][t].records = malloc(TRACE_CAPACITY * sizeof(TraceRecord))) != NULL;
+	trace->file = ok ? fopen(path, "w") : NULL;
+	if(trace->file == NULL) {
+		traceClose(trace);
+		return NULL;
+	}
+	trace->writer = workerCreate();
+	trace->start = timeNanos();
+
+	// The closing bracket is optional in this format, so the file stays
+	// readable if the frontend never unloads the core.
+	fprintf(trace->file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"uw8\"}}");
+	for(int t = 0; t < TRACE_THREADS; ++t)
+		fprintf(trace->file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			t + 1, threadNames[t]);
+	return trace;
+}
+
+void
+traceFrame(Trace* trace)
+{
+	for(int t = 0; t < TRACE_THREADS; ++t) {
+		if(trace->buffers[trace->current][t].count >= TRACE_CAPACITY / 2) {
+			flush(trace);
+			return;
+		}
+	}
+}
+
+void
+traceClose(Trace* trace)
+{
+	if(trace == NULL)
+		return;
+	if(trace->file) {
+		flush(trace);
+		if(trace->writer)
+			workerWait(trace->writer);
+		if(trace->dropped)
+			fprintf(trace->file, ",\n{\"name\":\"dropped events\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"count\":%u}}",
+				(timeNanos() - trace->start) / 1000.0, trace->dropped);
+		fprintf(trace->file, "\n]\n");
+		fclose(trace->file);
+	}
+	workerDestroy(trace->writer);
+	for(int b = 0; b < 2; ++b)
+		for(int t = 0; t < TRACE_THREADS; ++t)
+			free(trace->buffers[b][t].records);
+	free(trace);
+}
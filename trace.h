@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Frame timelines in the trace event format read by chrome://tracing and
+// Perfetto. Events go into per-thread buffers without any locking and are
+// written out by a background thread, so tracing can stay on for whole
+// sessions. The calls are a single branch while trace is NULL.
+typedef struct Trace Trace;
+
+typedef enum TraceName {
+	TRACE_RUN, // all of retro_run
+	TRACE_INPUT,
+	TRACE_UPD,
+	TRACE_RESOLVE,
+	TRACE_VIDEO,
+	TRACE_SND,
+	TRACE_AUDIO,
+	// counters
+	TRACE_IMPORT_CALLS,
+	TRACE_IMPORT_MICROS,
+	TRACE_NAMES
+} TraceName;
+
+// Each thread records into its own buffers.
+typedef enum TraceThread {
+	TRACE_MAIN,
+	TRACE_WORKER,
+	TRACE_THREADS
+} TraceThread;
+
+Trace* traceOpen(const char* path);
+void traceEvent(Trace* trace, TraceThread thread, TraceName name, char phase, uint32_t value);
+// Call once per frame while no other thread records. Hands the events to
+// the writer thread when the buffers are half full.
+void traceFrame(Trace* trace);
+void traceClose(Trace* trace);
+
+static inline void
+traceBegin(Trace* trace, TraceThread thread, TraceName name)
+{
+	if(trace)
+		traceEvent(trace, thread, name, 'B', 0);
+}
+
+static inline void
+traceEnd(Trace* trace, TraceThread thread, TraceName name)
+{
+	if(trace)
+		traceEvent(trace, thread, name, 'E', 0);
+}
+
+static inline void
+traceCounter(Trace* trace, TraceName name, uint32_t value)
+{
+	if(trace)
+		traceEvent(trace, TRACE_MAIN, name, 'C', value);
+}
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "unpack.h"
+
+// The compressed base module, identical to the data segment of the loader.
+static const uint8_t baseModuleCompressed[] = {
+	0xff, 0x9f, 0x97, 0xbc, 0x33, 0x66, 0xca, 0x12, 0x2c, 0xaa, 0xa6, 0xb1,
+	0xe8, 0x64, 0x7c, 0x9f, 0xa8, 0x5e, 0x2c, 0xd7, 0x27, 0xc9, 0x2b, 0x8c,
+	0x1a, 0xfa, 0x33, 0x1e, 0x5d, 0x5a, 0x44, 0x7d, 0xe9, 0xa6, 0x67, 0x43,
+	0x25, 0x96, 0x19, 0xa5, 0xf3, 0x41, 0xd5, 0x99, 0x7e, 0x97, 0x1d, 0xf5,
+	0x71, 0x69, 0x74, 0xdf, 0x5b, 0xac, 0x4f, 0x19, 0x05, 0x0a, 0x34, 0x9f,
+	0x75, 0xab, 0xfe, 0xcf, 0xb0, 0x71, 0xd1, 0x54, 0x5b, 0xad, 0x3b, 0xf4,
+	0x31, 0x1c, 0x0f, 0x08, 0xd8, 0x9a, 0xbc, 0x60, 0xe6, 0x9b, 0x45, 0xe2,
+	0x8e, 0xc8, 0x94, 0x89, 0xb0, 0xc4, 0x48, 0x49, 0x49, 0x6a, 0xc1, 0x6e,
+	0xd2, 0x5e, 0xa6, 0x36, 0x9e, 0x0b, 0x83, 0xe8, 0x8d, 0x5e, 0xc9, 0x82,
+	0x1a, 0xf5, 0x54, 0xfc, 0x03, 0xb1, 0xcf, 0x37, 0x46, 0xcb, 0xae, 0x0b,
+	0x22, 0xf4, 0xdf, 0xbf, 0x75, 0xbb, 0x09, 0x70, 0x8b, 0x44, 0xfc, 0x98,
+	0x94, 0x7e, 0xb2, 0x51, 0xfc, 0xd9, 0xc9, 0x0a, 0x94, 0x2e, 0x53, 0x2b,
+	0xac, 0x27, 0x3f, 0x2a, 0x01, 0xf7, 0x4f, 0x24, 0x49, 0xe2, 0xd8, 0xf8,
+	0x48, 0x6e, 0x9c, 0x38, 0x6d, 0x58, 0x70, 0x3b, 0x11, 0x6c, 0x30, 0x75,
+	0x0b, 0xe2, 0x81, 0x83, 0x21, 0x4d, 0x0e, 0x82, 0xca, 0x2f, 0x97, 0x7a,
+	0x59, 0x12, 0xab, 0xa0, 0xa7, 0x09, 0x09, 0xd9, 0xac, 0x0a, 0x97, 0xae,
+	0xf1, 0x2c, 0x49, 0xee, 0xfe, 0x60, 0xdb, 0x77, 0x1e, 0x0d, 0x0c, 0x17,
+	0x27, 0x17, 0x79, 0xd0, 0xc8, 0xa0, 0x50, 0x0d, 0x04, 0x3c, 0x9f, 0x3d,
+	0xac, 0xa7, 0xd1, 0x5a, 0x72, 0x24, 0x1f, 0xe2, 0x81, 0xc2, 0xd2, 0x51,
+	0x59, 0xe0, 0x0a, 0x56, 0x21, 0xea, 0xa8, 0x9b, 0x8f, 0xfa, 0x8c, 0x50,
+	0x9a, 0x77, 0x50, 0xca, 0x28, 0x3c, 0xaf, 0x46, 0x1e, 0x07, 0x81, 0x9f,
+	0x92, 0xf8, 0x10, 0xc0, 0xca, 0xb6, 0x8d, 0xbd, 0x9c, 0xa3, 0x33, 0xb8,
+	0x6b, 0xa5, 0xfd, 0x4f, 0xdc, 0xb2, 0xb4, 0xe9, 0x1a, 0xf3, 0x2c, 0x36,
+	0x1b, 0xcf, 0xf6, 0x88, 0x91, 0x6c, 0x62, 0xd3, 0xfa, 0xd2, 0x8d, 0xf5,
+	0x8d, 0x3c, 0x93, 0x7b, 0xa6, 0x02, 0xe2, 0xa0, 0x66, 0xe3, 0xde, 0x8e,
+	0x14, 0x9a, 0x46, 0xee, 0xfd, 0x89, 0xba, 0xd3, 0x62, 0xc1, 0x66, 0xa7,
+	0xe8, 0xcc, 0xfa, 0xba, 0xf8, 0xaa, 0xc4, 0xed, 0x6e, 0x5d, 0xef, 0x8d,
+	0xad, 0x03, 0xb7, 0xb5, 0x49, 0x45, 0x01, 0xaa, 0xc6, 0xfe, 0xd0, 0x25,
+	0x48, 0x58, 0x91, 0xdb, 0x6c, 0x09, 0x3a, 0x80, 0xcd, 0xe7, 0xe5, 0x6d,
+	0x07, 0x9d, 0x67, 0xf2, 0xe4, 0xf0, 0x6a, 0x81, 0x1a, 0x6c, 0x7f, 0xd7,
+	0x11, 0xfb, 0xfa, 0x6b, 0x6b, 0x60, 0xb8, 0xbc, 0x57, 0xf7, 0x29, 0x59,
+	0xdf, 0x1a, 0xf3, 0xdd, 0x0d, 0x4c, 0x05, 0xc9, 0xf3, 0x42, 0x8f, 0x58,
+	0x97, 0x22, 0xb9, 0x11, 0x29, 0x96, 0x64, 0xc5, 0xb4, 0x66, 0xba, 0xe2,
+	0x0a, 0x82, 0x0d, 0x1c, 0x30, 0x6c, 0xec, 0xec, 0x7f, 0xc7, 0x26, 0x7f,
+	0xa9, 0x17, 0x8d, 0xc0, 0x72, 0x22, 0xd4, 0x7d, 0xab, 0x4e, 0x7b, 0x65,
+	0xa5, 0xe2, 0xd0, 0x5b, 0x85, 0x5e, 0x6d, 0xf9, 0x9a, 0x88, 0x64, 0x7a,
+	0x8b, 0xc5, 0x61, 0xe4, 0x97, 0x2b, 0xf7, 0x15, 0xc3, 0x33, 0xa6, 0xc6,
+	0x54, 0x72, 0x32, 0x25, 0x13, 0x9e, 0xc6, 0x90, 0xdb, 0xdf, 0x72, 0xb3,
+	0xec, 0xf8, 0x44, 0x79, 0xa7, 0x1c, 0xf2, 0xac, 0x3e, 0x15, 0x93, 0xe3,
+	0x68, 0xff, 0x9f, 0x5b, 0xa2, 0x70, 0x39, 0xb9, 0x81, 0x5c, 0x70, 0xe1,
+	0xb4, 0x8f, 0x39, 0x16, 0x4a, 0xf4, 0xdc, 0xef, 0x93, 0xdc, 0xb7, 0xfa,
+};
+
+static uint8_t* baseModule;
+static uint32_t baseModuleSize;
+
+// The base module's sections, indexed once so that merging only has to
+// walk the cart's own sections.
+#define MAX_BASE_SECTIONS 16
+
+typedef struct BaseSection {
+	uint8_t id;
+	const uint8_t* data; // including id and size field
+	size_t size;
+} BaseSection;
+
+static BaseSection baseSections[MAX_BASE_SECTIONS];
+static int baseSectionCount;
+
+// upkr is an LZ scheme with an adaptive binary range coder. The contexts
+// are: 0 match flag, 1..255 literal bits, 256 new offset flag, 257..320
+// offset, 321..384 length.
+#define UPKR_CONTEXTS 385
+#define UPKR_MAX_OUTPUT (4 << 20)
+
+typedef struct Upkr {
+	const uint8_t* in;
+	const uint8_t* inEnd;
+	uint32_t state;
+	uint8_t probs[UPKR_CONTEXTS];
+} Upkr;
+
+static inline int
+upkrBit(Upkr* upkr, int context)
+{
+	while(upkr->state < 4096)
+		upkr->state = (upkr->state << 8) | (upkr->in < upkr->inEnd ? *upkr->in++ : 0);
+	uint32_t prob = upkr->probs[context];
+	uint32_t low = upkr->state & 255;
+	uint32_t high = upkr->state >> 8;
+	int bit = low < prob;
+	if(bit) {
+		upkr->state = prob * high + low;
+		upkr->probs[context] = (uint8_t)(prob + ((264 - prob) >> 4));
+	} else {
+		upkr->state = (256 - prob) * high + low - prob;
+		upkr->probs[context] = (uint8_t)(prob - ((prob + 8) >> 4));
+	}
+	return bit;
+}
+
+static inline uint32_t
+upkrNumber(Upkr* upkr, int context)
+{
+	uint32_t value = 0;
+	int bits = 0;
+	while(bits < 31 && upkrBit(upkr, context + bits)) {
+		value |= (uint32_t)upkrBit(upkr, context + bits + 32) << bits;
+		++bits;
+	}
+	return value | (1u << bits);
+}
+
+uint8_t*
+upkrUncompress(const uint8_t* in, size_t inSize, uint32_t* sizeOut)
+{
+	Upkr upkr;
+	upkr.in = in;
+	upkr.inEnd = in + inSize;
+	upkr.state = 0;
+	memset(upkr.probs, 128, sizeof(upkr.probs));
+
+	size_t capacity = inSize * 4 + 256;
+	size_t size = 0;
+	uint8_t* out = malloc(capacity);
+	uint32_t offset = 0;
+	int prevWasMatch = 0;
+	while(out) {
+		int isMatch = upkrBit(&upkr, 0);
+		if(isMatch) {
+			if(prevWasMatch || upkrBit(&upkr, 256)) {
+				offset = upkrNumber(&upkr, 257) - 1;
+				if(offset == 0)
+					break;
+			}
+			uint32_t length = upkrNumber(&upkr, 321);
+			if(offset > size || size + length > UPKR_MAX_OUTPUT)
+				goto fail;
+			if(size + length > capacity) {
+				capacity = (size + length) * 2;
+				uint8_t* grown = realloc(out, capacity);
+				if(grown == NULL)
+					goto fail;
+				out = grown;
+			}
+			// byte by byte, the source may overlap the destination
+			uint8_t* dst = out + size;
+			const uint8_t* src = dst - offset;
+			for(uint32_t i = 0; i < length; ++i)
+				dst[i] = src[i];
+			size += length;
+		} else {
+			uint32_t byte = 1;
+			while(byte < 256)
+				byte = (byte << 1) | upkrBit(&upkr, byte);
+			if(size == capacity) {
+				if(size >= UPKR_MAX_OUTPUT)
+					goto fail;
+				capacity *= 2;
+				uint8_t* grown = realloc(out, capacity);
+				if(grown == NULL)
+					goto fail;
+				out = grown;
+			}
+			out[size++] = (uint8_t)byte;
+		}
+		prevWasMatch = isMatch;
+	}
+	if(out)
+		*sizeOut = (uint32_t)size;
+	return out;
+
+fail:
+	free(out);
+	return NULL;
+}
+
+// Total size of the section at p including id and size field, 0 if it
+// does not fit before end.
+static size_t
+sectionSize(const uint8_t* p, const uint8_t* end)
+{
+	const uint8_t* q = p + 1;
+	uint32_t size = 0;
+	for(int shift = 0; ; shift += 7) {
+		if(q >= end || shift > 28)
+			return 0;
+		uint8_t byte = *q++;
+		size |= (uint32_t)(byte & 127) << shift;
+		if(!(byte & 128))
+			break;
+	}
+	if(size > (size_t)(end - q))
+		return 0;
+	return (size_t)(q - p) + size;
+}
+
+void
+unpackInit(void)
+{
+	if(baseModule != NULL)
+		return;
+	baseModule = upkrUncompress(baseModuleCompressed, sizeof(baseModuleCompressed), &baseModuleSize);
+
+	const uint8_t* p = baseModule + 8;
+	const uint8_t* end = baseModule + baseModuleSize;
+	baseSectionCount = 0;
+	while(p < end && baseSectionCount < MAX_BASE_SECTIONS) {
+		BaseSection* section = &baseSections[baseSectionCount++];
+		section->id = *p;
+		section->data = p;
+		section->size = sectionSize(p, end);
+		p += section->size;
+	}
+}
+
+void
+unpackFree(void)
+{
+	free(baseModule);
+	baseModule = NULL;
+	baseModuleSize = 0;
+	baseSectionCount = 0;
+}
+
+const uint8_t*
+unpackBaseModule(uint32_t* size)
+{
+	*size = baseModuleSize;
+	return baseModule;
+}
+
+uint8_t*
+unpackUw8(const uint8_t* cart, size_t cartSize, uint32_t* sizeOut)
+{
+	if(cartSize == 0 || baseModule == NULL)
+		return NULL;
+
+	// version 0 is a plain wasm module
+	if(cart[0] == 0) {
+		uint8_t* wasm = malloc(cartSize);
+		if(wasm) {
+			memcpy(wasm, cart, cartSize);
+			*sizeOut = (uint32_t)cartSize;
+		}
+		return wasm;
+	}
+
+	uint8_t* body = NULL;
+	uint32_t bodySize = (uint32_t)cartSize - 1;
+	const uint8_t* sections = cart + 1;
+	if((cart[0] - 1) & 1) {
+		body = upkrUncompress(cart + 1, cartSize - 1, &bodySize);
+		if(body == NULL)
+			return NULL;
+		sections = body;
+	}
+
+	// merge the cart's sections into the base module's, in id order, with
+	// cart sections replacing base sections of the same id
+	uint8_t* out = malloc(8 + bodySize + baseModuleSize);
+	uint8_t* o = out;
+	const uint8_t* c = sections;
+	const uint8_t* cEnd = sections + bodySize;
+	const BaseSection* b = baseSections;
+	const BaseSection* bEnd = baseSections + baseSectionCount;
+	if(out == NULL)
+		goto fail;
+	memcpy(o, baseModule, 8);
+	o += 8;
+	while(c < cEnd) {
+		for(; b < bEnd && b->id < *c; ++b) {
+			memcpy(o, b->data, b->size);
+			o += b->size;
+		}
+		if(b < bEnd && b->id == *c)
+			++b;
+		size_t size = sectionSize(c, cEnd);
+		if(size == 0)
+			goto fail;
+		memcpy(o, c, size);
+		o += size;
+		c += size;
+	}
+	for(; b < bEnd; ++b) {
+		memcpy(o, b->data, b->size);
+		o += b->size;
+	}
+	free(body);
+	*sizeOut = (uint32_t)(o - out);
+	return out;
+
+fail:
+	free(body);
+	free(out);
+	return NULL;
+}
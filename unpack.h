@@ -0,0 +1,18 @@
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Native implementation of the uw8 loader: decompresses a .uw8 cart and
+// merges its sections with the base module. Results are malloc'ed and
+// NULL if the cart is malformed.
+void unpackInit(void);
+void unpackFree(void);
+
+uint8_t* upkrUncompress(const uint8_t* in, size_t inSize, uint32_t* sizeOut);
+uint8_t* unpackUw8(const uint8_t* cart, size_t cartSize, uint32_t* sizeOut);
+// The uncompressed base module, valid between unpackInit and unpackFree.
+const uint8_t* unpackBaseModule(uint32_t* size);
+
+#endif
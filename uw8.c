@@ -5,28 +5,89 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <assert.h>
+#include <stdarg.h>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
 
 #include <wasm3.h>
 #include <m3_env.h>
 
 #include "loader.h"
 #include "platform.h"
+#include "env.h"
+#include "memimage.h"
+#include "worker.h"
+#include "unpack.h"
+#include "instrument.h"
+#include "uw8math.h"
+#include "text.h"
+#include "timing.h"
+#include "bytes.h"
+#include "uw8.h"
+#include "movie.h"
+#include "hashlog.h"
+#include "trace.h"
 #include "libretro.h"
 
+#if defined(HAVE_THREADS)
+#include <pthread.h>
+#endif
+
+static void
+fallbackLog(enum retro_log_level level, const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
 static retro_input_state_t input_state_cb;
 static retro_input_poll_t input_poll_cb;
 static retro_video_refresh_t video_cb;
 static retro_environment_t environ_cb;
-retro_audio_sample_t audio_cb;
+static retro_log_printf_t log_cb = fallbackLog;
+static retro_audio_sample_t audio_cb;
 
 typedef struct {
 	IM3Runtime runtime;
-	wasm_rt_memory_t memory_c;
+	struct Z_env_instance_t env_c;
 	Z_platform_instance_t platform_c;
+	GlyphCache glyphs;
 	IM3Module cart;
+	uint32_t globalCount; // the cart's own, without instrumentation counters
+	const Instrumentation* instrumentation; // NULL unless instrumented
+	bool memoryMapped; // memory is a copy-on-write mapping of the initial image
+	// state after start(), restored on reset
+	Z_platform_instance_t initialPlatform;
+	u32 initialReserved[16];
+	M3TaggedValue* initialGlobals;
+	// only set while profiling
+	struct Profile* profile;
+	struct ProfileTree* profileTree;
+	uint32_t profileRoot; // the entry point being called
+	uint32_t profileNode; // the innermost call
+	uint32_t profileDepth;
+	uint32_t profileSkipped; // calls too deep for the stack, or out of memory
+	uint64_t* profileStarts; // per depth
+	struct ProfiledImport* profiledImports;
 } Uw8Runtime;
 
+// Runtimes are created ahead of time so that switching carts only has to
+// parse and compile the new cart. Each pooled runtime already owns its
+// zeroed 256 KiB linear memory.
+#define RUNTIME_POOL_SIZE 1
+
+typedef struct RuntimePool {
+	IM3Runtime runtimes[RUNTIME_POOL_SIZE];
+	uint32_t count;
+} RuntimePool;
+
 typedef struct AudioState {
+	IM3Environment env; // separate from the game's, so both can be set up in parallel
+	RuntimePool pool;
 	Uw8Runtime runtime;
 	uint8_t* memory;
 	IM3Function snd;
@@ -37,45 +98,55 @@ typedef struct AudioState {
 
 typedef struct GameState {
 	IM3Environment env;
+	RuntimePool pool;
+	void* cartWasm;
+	uint32_t cartWasmSize;
+	// what the runtimes parsed and reference until the cart is unloaded,
+	// cartWasm unless it was instrumented
+	void* moduleWasm;
+	Instrumentation instrumentation;
+	uint64_t moduleHash; // identifies the cart in saved states
 	Uw8Runtime runtime;
 	uint8_t* memory;
-	uint8_t* initialMemory; // used for reset
+	MemImage initialMemory; // used for reset
 	IM3Function updFunc;
 	bool hasUpdFunc;
-	uint32_t* pixels32;
+	bool lazyCompile; // compile cart functions on first call instead of at load
 	uint32_t frameNumber;
 } GameState;
 
-AudioState* audioState;
-GameState* gameState;
+struct Uw8Core {
+	GameState game;
+	AudioState audio;
+	bool profiling; // for the next load
+	struct Profile* profile;
+	Worker* loadWorker; // sets up the audio runtime, created on the first load
+};
 
-#define MATH1(name) \
-f32 Z_envZ_##name(struct Z_env_instance_t* i, f32 v) { \
-	return name##f(v); \
-}
-#define MATH2(name) \
-f32 Z_envZ_##name(struct Z_env_instance_t* i, f32 a, f32 b) { \
-	return name##f(a, b); \
-}
-MATH1(acos); MATH1(asin); MATH1(atan); MATH2(atan2);
-MATH1(cos); MATH1(sin); MATH1(tan);
-MATH1(exp); MATH2(pow);
-void Z_envZ_logChar(struct Z_env_instance_t* i, u32 c) {}
+// The instance behind the libretro entry points, and what only the
+// frontend side of it needs.
+static Uw8Core* retroCore;
+static enum retro_pixel_format pixelFormat;
+static void* pixels; // only allocated if the frontend has no framebuffer to offer
+static Worker* videoWorker; // resolves frames in parallel to the audio, if enabled
+static uint64_t loadStart; // cleared once the time to the first frame is logged
 
-u32 reservedGlobal;
-#define G_RESERVED(n) u32* Z_envZ_g_reserved##n(struct Z_env_instance_t* i) { return &reservedGlobal; }
-G_RESERVED(0); G_RESERVED(1); G_RESERVED(2); G_RESERVED(3);
-G_RESERVED(4); G_RESERVED(5); G_RESERVED(6); G_RESERVED(7);
-G_RESERVED(8); G_RESERVED(9); G_RESERVED(10); G_RESERVED(11);
-G_RESERVED(12); G_RESERVED(13); G_RESERVED(14); G_RESERVED(15);
-wasm_rt_memory_t* Z_envZ_memory(struct Z_env_instance_t* i) { return (wasm_rt_memory_t*)i; }
+// Input movie of the loaded cart, see the uw8_movie option
+#define MOVIE_KEYFRAME_INTERVAL (60 * 10)
+static Movie* movie;
+static bool movieRecording;
+static char moviePath[1024];
 
-void
-retro_init(void)
-{
-	audioState = malloc(sizeof(AudioState));
-	gameState = malloc(sizeof(GameState));
-}
+// Per-frame output hashes, see the uw8_hash_log option
+static HashLog* hashLog;
+static uint32_t hashLogFrames;
+
+// Written at unload if the uw8_profile option is on, empty otherwise
+static char profilePath[1024];
+
+// Frame timeline, see the uw8_trace option
+static Trace* trace;
+static uint64_t traceImportCalls, traceImportNanos; // totals at the last frame
 
 void
 retro_get_system_info(struct retro_system_info *info)
@@ -118,52 +189,34 @@ verifyM3(IM3Runtime runtime, M3Result result)
 	}
 }
 
-m3ApiRawFunction(math1)
-{
-	m3ApiReturnType(float);
-	m3ApiGetArg(float, v);
-	*raw_return = ((float(*)(float))_ctx->userdata)(v);
-	m3ApiSuccess();
+// One raw function per math import, so the call into uw8math is direct.
+#define MATH1_IMPORT(name, function) \
+m3ApiRawFunction(name) \
+{ \
+	m3ApiReturnType(float); \
+	m3ApiGetArg(float, v); \
+	*raw_return = function(v); \
+	m3ApiSuccess(); \
 }
-
-m3ApiRawFunction(math2)
-{
-	m3ApiReturnType(float);
-	m3ApiGetArg(float, a);
-	m3ApiGetArg(float, b);
-	*raw_return = ((float(*)(float, float))_ctx->userdata)(a, b);
-	m3ApiSuccess();
+#define MATH2_IMPORT(name, function) \
+m3ApiRawFunction(name) \
+{ \
+	m3ApiReturnType(float); \
+	m3ApiGetArg(float, a); \
+	m3ApiGetArg(float, b); \
+	*raw_return = function(a, b); \
+	m3ApiSuccess(); \
 }
+MATH1_IMPORT(callAcos, uw8Acos) MATH1_IMPORT(callAsin, uw8Asin) MATH1_IMPORT(callAtan, uw8Atan)
+MATH2_IMPORT(callAtan2, uw8Atan2) MATH1_IMPORT(callCos, uw8Cos) MATH1_IMPORT(callExp, uw8Exp)
+MATH1_IMPORT(callLog, uw8Log) MATH1_IMPORT(callSin, uw8Sin) MATH1_IMPORT(callTan, uw8Tan)
+MATH2_IMPORT(callPow, uw8Pow)
 
 m3ApiRawFunction(nopFunc)
 {
 	m3ApiSuccess();
 }
 
-void
-linkSystemFunctions(IM3Runtime runtime, IM3Module mod)
-{
-	m3_LinkRawFunctionEx(mod, "env", "acos", "f(f)", math1, acosf);
-	m3_LinkRawFunctionEx(mod, "env", "asin", "f(f)", math1, asinf);
-	m3_LinkRawFunctionEx(mod, "env", "atan", "f(f)", math1, atanf);
-	m3_LinkRawFunctionEx(mod, "env", "atan2", "f(ff)", math2, atan2f);
-	m3_LinkRawFunctionEx(mod, "env", "cos", "f(f)", math1, cosf);
-	m3_LinkRawFunctionEx(mod, "env", "exp", "f(f)", math1, expf);
-	m3_LinkRawFunctionEx(mod, "env", "log", "f(f)", math1, logf);
-	m3_LinkRawFunctionEx(mod, "env", "sin", "f(f)", math1, sinf);
-	m3_LinkRawFunctionEx(mod, "env", "tan", "f(f)", math1, tanf);
-	m3_LinkRawFunctionEx(mod, "env", "pow", "f(ff)", math2, powf);
-
-	m3_LinkRawFunction(mod, "env", "logChar", "v(i)", nopFunc);
-
-	for(int i = 9; i < 64; ++i)
-	{
-		char name[128];
-		sprintf(name, "reserved%d", i);
-		m3_LinkRawFunction(mod, "env", name, "v()", nopFunc);
-	}
-}
-
 m3ApiRawFunction(callFmod) {
 	*(f32*)&_sp[0] = Z_platformZ_fmod((Z_platform_instance_t*)_ctx->userdata, *(f32*)&_sp[1], *(f32*)&_sp[2]);
 	m3ApiSuccess();
@@ -255,17 +308,20 @@ m3ApiRawFunction(callTime) {
 }
 
 m3ApiRawFunction(callPrintChar) {
-	Z_platformZ_printChar((Z_platform_instance_t*)_ctx->userdata, _sp[0]);
+	Uw8Runtime* uw8 = _ctx->userdata;
+	textPrintChar(&uw8->platform_c, &uw8->glyphs, _sp[0]);
 	m3ApiSuccess();
 }
 
 m3ApiRawFunction(callPrintString) {
-	Z_platformZ_printString((Z_platform_instance_t*)_ctx->userdata, _sp[0]);
+	Uw8Runtime* uw8 = _ctx->userdata;
+	textPrintString(&uw8->platform_c, &uw8->glyphs, _sp[0]);
 	m3ApiSuccess();
 }
 
 m3ApiRawFunction(callPrintInt) {
-	Z_platformZ_printInt((Z_platform_instance_t*)_ctx->userdata, _sp[0]);
+	Uw8Runtime* uw8 = _ctx->userdata;
+	textPrintInt(&uw8->platform_c, &uw8->glyphs, (int32_t)_sp[0]);
 	m3ApiSuccess();
 }
 
@@ -294,121 +350,1499 @@ m3ApiRawFunction(callPlayNote) {
 	m3ApiSuccess();
 }
 
-struct {
+#define RESERVED(n) { "env", "reserved" #n, "v()", nopFunc, NULL }
+#define RUNTIME_USERDATA ((void*)1)
+
+typedef struct {
+	const char* module;
 	const char* name;
 	const char* signature;
 	M3RawCall function;
-} cPlatformFunctions[] = {
-	{ "fmod", "f(ff)", callFmod },
-	{ "random", "i()", callRandom },
-	{ "randomf", "f()", callRandomf },
-	{ "randomSeed", "v(i)", callRandomSeed },
-	{ "cls", "v(i)", callCls },
-	{ "setPixel", "v(iii)", callSetPixel },
-	{ "getPidel", "i(ii)", callGetPixel },
-	{ "hline", "v(iiii)", callHline },
-	{ "rectangle", "v(ffffi)", callRectangle },
-	{ "circle", "v(fffi)", callCircle },
-	{ "rectangleOutline", "v(ffffi)", callRectangleOutline },
-	{ "circleOutline", "v(fffi)", callCircleOutline },
-	{ "line", "v(ffffi)", callLine },
-	{ "blitSprite", "v(iiiii)", callBlitSprite },
-	{ "grabSprite", "v(iiiii)", callGrabSprite },
-	{ "isButtonPressed", "i(i)", callIsButtonPressed },
-	{ "isButtonTriggered", "i(i)", callIsButtonTriggered},
-	{ "time", "f()", callTime },
-	{ "printChar", "v(i)", callPrintChar },
-	{ "printString", "v(i)", callPrintString },
-	{ "printInt", "v(i)", callPrintInt },
-	{ "setTextColor", "v(i)", callSetTextColor },
-	{ "setBackgroundColor", "v(i)", callSetBackgroundColor },
-	{ "setCursorPosition", "v(ii)", callSetCursorPosition },
-	{ "playNote", "v(ii)", callPlayNote },
-	{ "sndGes", "f(i)", callSndGes }
+	void* userdata; // NULL: the function receives the platform instance, RUNTIME_USERDATA: the Uw8Runtime
+} ImportFunction;
+
+static const ImportFunction cImports[] = {
+	{ "env", "acos", "f(f)", callAcos, NULL },
+	{ "env", "asin", "f(f)", callAsin, NULL },
+	{ "env", "atan", "f(f)", callAtan, NULL },
+	{ "env", "atan2", "f(ff)", callAtan2, NULL },
+	{ "env", "cos", "f(f)", callCos, NULL },
+	{ "env", "exp", "f(f)", callExp, NULL },
+	{ "env", "log", "f(f)", callLog, NULL },
+	{ "env", "sin", "f(f)", callSin, NULL },
+	{ "env", "tan", "f(f)", callTan, NULL },
+	{ "env", "pow", "f(ff)", callPow, NULL },
+	{ "env", "logChar", "v(i)", nopFunc, NULL },
+
+	RESERVED(9), RESERVED(10), RESERVED(11), RESERVED(12), RESERVED(13),
+	RESERVED(14), RESERVED(15), RESERVED(16), RESERVED(17), RESERVED(18),
+	RESERVED(19), RESERVED(20), RESERVED(21), RESERVED(22), RESERVED(23),
+	RESERVED(24), RESERVED(25), RESERVED(26), RESERVED(27), RESERVED(28),
+	RESERVED(29), RESERVED(30), RESERVED(31), RESERVED(32), RESERVED(33),
+	RESERVED(34), RESERVED(35), RESERVED(36), RESERVED(37), RESERVED(38),
+	RESERVED(39), RESERVED(40), RESERVED(41), RESERVED(42), RESERVED(43),
+	RESERVED(44), RESERVED(45), RESERVED(46), RESERVED(47), RESERVED(48),
+	RESERVED(49), RESERVED(50), RESERVED(51), RESERVED(52), RESERVED(53),
+	RESERVED(54), RESERVED(55), RESERVED(56), RESERVED(57), RESERVED(58),
+	RESERVED(59), RESERVED(60), RESERVED(61), RESERVED(62), RESERVED(63),
+
+	{ "env", "fmod", "f(ff)", callFmod, NULL },
+	{ "env", "random", "i()", callRandom, NULL },
+	{ "env", "randomf", "f()", callRandomf, NULL },
+	{ "env", "randomSeed", "v(i)", callRandomSeed, NULL },
+	{ "env", "cls", "v(i)", callCls, NULL },
+	{ "env", "setPixel", "v(iii)", callSetPixel, NULL },
+	{ "env", "getPixel", "i(ii)", callGetPixel, NULL },
+	{ "env", "hline", "v(iiii)", callHline, NULL },
+	{ "env", "rectangle", "v(ffffi)", callRectangle, NULL },
+	{ "env", "circle", "v(fffi)", callCircle, NULL },
+	{ "env", "rectangleOutline", "v(ffffi)", callRectangleOutline, NULL },
+	{ "env", "circleOutline", "v(fffi)", callCircleOutline, NULL },
+	{ "env", "line", "v(ffffi)", callLine, NULL },
+	{ "env", "blitSprite", "v(iiiii)", callBlitSprite, NULL },
+	{ "env", "grabSprite", "v(iiiii)", callGrabSprite, NULL },
+	{ "env", "isButtonPressed", "i(i)", callIsButtonPressed, NULL },
+	{ "env", "isButtonTriggered", "i(i)", callIsButtonTriggered, NULL },
+	{ "env", "time", "f()", callTime, NULL },
+	{ "env", "printChar", "v(i)", callPrintChar, RUNTIME_USERDATA },
+	{ "env", "printString", "v(i)", callPrintString, RUNTIME_USERDATA },
+	{ "env", "printInt", "v(i)", callPrintInt, RUNTIME_USERDATA },
+	{ "env", "setTextColor", "v(i)", callSetTextColor, NULL },
+	{ "env", "setBackgroundColor", "v(i)", callSetBackgroundColor, NULL },
+	{ "env", "setCursorPosition", "v(ii)", callSetCursorPosition, NULL },
+	{ "env", "playNote", "v(ii)", callPlayNote, NULL },
+	{ "env", "sndGes", "f(i)", callSndGes, NULL }
 };
 
+#undef RESERVED
+
+#define IMPORT_COUNT (sizeof(cImports) / sizeof(cImports[0]))
+
+// Perfect hash over (module, name) for cImports: the FNV-1a hash with seed 0
+// picks one of the buckets, the bucket's seed then hashes the import into a
+// collision-free slot. Both tables are built from cImports by
+// buildImportTable when the first core is created.
+#define IMPORT_BUCKETS 32
+#define IMPORT_SLOTS 128
+
+static uint8_t importSeeds[IMPORT_BUCKETS];
+// cImports index + 1 per slot, 0 for empty slots
+static uint8_t importSlots[IMPORT_SLOTS];
+
+static uint32_t
+importHash(const char* module, const char* name, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+	for(const char* c = module; *c; ++c)
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	hash *= 16777619u; // the separating NUL byte
+	for(const char* c = name; *c; ++c)
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	return hash;
+}
+
+static const ImportFunction*
+findImport(const char* module, const char* name)
+{
+	uint32_t seed = importSeeds[importHash(module, name, 0) % IMPORT_BUCKETS];
+	uint8_t index = importSlots[importHash(module, name, seed) % IMPORT_SLOTS];
+	if(index == 0)
+		return NULL;
+	const ImportFunction* import = &cImports[index - 1];
+	if(strcmp(import->name, name) != 0 || strcmp(import->module, module) != 0)
+		return NULL;
+	return import;
+}
+
+// Finds a seed that puts all imports of the bucket into free slots.
+static bool
+placeImportBucket(uint32_t bucket, const uint8_t* buckets)
+{
+	for(uint32_t seed = 1; seed < 256; ++seed) {
+		uint32_t slots[IMPORT_COUNT];
+		uint32_t count = 0;
+		bool fits = true;
+		for(uint32_t i = 0; fits && i < IMPORT_COUNT; ++i) {
+			if(buckets[i] != bucket)
+				continue;
+			uint32_t slot = importHash(cImports[i].module, cImports[i].name, seed) % IMPORT_SLOTS;
+			fits = importSlots[slot] == 0;
+			for(uint32_t j = 0; fits && j < count; ++j)
+				fits = slots[j] != slot;
+			slots[count++] = slot;
+		}
+		if(!fits)
+			continue;
+		count = 0;
+		for(uint32_t i = 0; i < IMPORT_COUNT; ++i)
+			if(buckets[i] == bucket)
+				importSlots[slots[count++]] = (uint8_t)(i + 1);
+		importSeeds[bucket] = (uint8_t)seed;
+		return true;
+	}
+	return false;
+}
+
+// Places the fullest buckets first, while most slots are still free.
+static bool
+buildImportTable(void)
+{
+	uint8_t buckets[IMPORT_COUNT];
+	uint32_t bucketSizes[IMPORT_BUCKETS] = { 0 };
+	for(uint32_t i = 0; i < IMPORT_COUNT; ++i) {
+		buckets[i] = (uint8_t)(importHash(cImports[i].module, cImports[i].name, 0) % IMPORT_BUCKETS);
+		++bucketSizes[buckets[i]];
+	}
+	memset(importSlots, 0, sizeof(importSlots));
+	for(uint32_t size = IMPORT_COUNT; size > 0; --size)
+		for(uint32_t bucket = 0; bucket < IMPORT_BUCKETS; ++bucket)
+			if(bucketSizes[bucket] == size && !placeImportBucket(bucket, buckets))
+				return false;
+	return true;
+}
+
+// The profiler measures the cart's entry points and, through a trampoline
+// in front of each import, the time spent in the platform. Calls between
+// cart functions go through the uw8profile.enter and leave hooks that
+// instrumentModule adds, giving a call tree per runtime.
+enum {
+	PROFILE_GAME_START,
+	PROFILE_UPD,
+	PROFILE_AUDIO_START,
+	PROFILE_SND,
+	PROFILE_ROOTS
+};
+
+static const char* const profileRootNames[PROFILE_ROOTS] = {
+	"game;start", "game;upd", "audio;start", "audio;snd"
+};
+
+// deeper calls are charged to the caller at this depth
+#define PROFILE_MAX_DEPTH 256
+
+typedef struct ProfileStats {
+	uint64_t calls;
+	uint64_t nanos;
+} ProfileStats;
+
+// Nodes 0 to PROFILE_ROOTS - 1 are the entry points, the others calls of
+// a cart function by their index in the cart's module, imports included.
+typedef struct ProfileNode {
+	uint32_t parent;
+	uint32_t function;
+	uint32_t firstChild; // 0 for none, as the roots are nobody's children
+	uint32_t nextSibling;
+	ProfileStats stats;
+} ProfileNode;
+
+typedef struct ProfileTree {
+	ProfileNode* nodes;
+	uint32_t count;
+	uint32_t capacity;
+} ProfileTree;
+
+typedef struct Profile {
+	ProfileStats imports[PROFILE_ROOTS][IMPORT_COUNT];
+	ProfileTree trees[2]; // game, audio
+	char** names; // by function index, NULL entries for unnamed ones
+	uint32_t nameCount;
+} Profile;
+
+typedef struct ProfiledImport {
+	M3ImportContext context; // what the import itself receives
+	M3RawCall function;
+	Uw8Runtime* runtime;
+	uint32_t index;
+	uint32_t cartFunction;
+} ProfiledImport;
+
+static void
+profileAdd(ProfileStats* stats, uint64_t calls, uint64_t start) {
+	stats->calls += calls;
+	stats->nanos += timeNanos() - start;
+}
+
+// Returns the start time for profileEnd, with the call stack reset in case
+// the previous call trapped. Without a profile the clock is left unread.
+static uint64_t
+profileBegin(Uw8Runtime* runtime) {
+	if(runtime->profile == NULL)
+		return 0;
+	runtime->profileNode = runtime->profileRoot;
+	runtime->profileDepth = 0;
+	runtime->profileSkipped = 0;
+	return timeNanos();
+}
+
+static void
+profileEnd(Uw8Runtime* runtime, uint64_t calls, uint64_t start) {
+	profileAdd(&runtime->profileTree->nodes[runtime->profileRoot].stats, calls, start);
+}
+
+static uint32_t
+profileChild(ProfileTree* tree, uint32_t parent, uint32_t function) {
+	uint32_t child = tree->nodes[parent].firstChild;
+	while(child && tree->nodes[child].function != function)
+		child = tree->nodes[child].nextSibling;
+	if(child)
+		return child;
+	if(tree->count == tree->capacity) {
+		ProfileNode* nodes = realloc(tree->nodes, tree->capacity * 2 * sizeof(ProfileNode));
+		if(nodes == NULL)
+			return 0;
+		tree->nodes = nodes;
+		tree->capacity *= 2;
+	}
+	child = tree->count++;
+	ProfileNode* node = &tree->nodes[child];
+	memset(node, 0, sizeof(*node));
+	node->parent = parent;
+	node->function = function;
+	node->nextSibling = tree->nodes[parent].firstChild;
+	tree->nodes[parent].firstChild = child;
+	return child;
+}
+
+static void
+profileEnter(Uw8Runtime* runtime, uint32_t function) {
+	uint32_t child = 0;
+	if(runtime->profileSkipped == 0 && runtime->profileDepth < PROFILE_MAX_DEPTH && runtime->profileStarts)
+		child = profileChild(runtime->profileTree, runtime->profileNode, function);
+	if(child == 0) {
+		++runtime->profileSkipped;
+		return;
+	}
+	runtime->profileNode = child;
+	runtime->profileStarts[runtime->profileDepth++] = timeNanos();
+}
+
+static void
+profileLeave(Uw8Runtime* runtime) {
+	if(runtime->profileSkipped > 0) {
+		--runtime->profileSkipped;
+		return;
+	}
+	if(runtime->profileDepth == 0)
+		return;
+	ProfileNode* node = &runtime->profileTree->nodes[runtime->profileNode];
+	profileAdd(&node->stats, 1, runtime->profileStarts[--runtime->profileDepth]);
+	runtime->profileNode = node->parent;
+}
+
+m3ApiRawFunction(callProfileEnter) {
+	profileEnter((Uw8Runtime*)_ctx->userdata, (uint32_t)_sp[0]);
+	m3ApiSuccess();
+}
+
+m3ApiRawFunction(callProfileLeave) {
+	profileLeave((Uw8Runtime*)_ctx->userdata);
+	m3ApiSuccess();
+}
+
+static Profile*
+profileCreate(void) {
+	Profile* profile = calloc(1, sizeof(Profile));
+	for(uint32_t t = 0; profile && t < 2; ++t) {
+		ProfileTree* tree = &profile->trees[t];
+		tree->capacity = 256;
+		tree->count = PROFILE_ROOTS;
+		tree->nodes = calloc(tree->capacity, sizeof(ProfileNode));
+		if(tree->nodes == NULL) {
+			free(profile->trees[0].nodes);
+			free(profile);
+			return NULL;
+		}
+		for(uint32_t root = 0; root < PROFILE_ROOTS; ++root)
+			tree->nodes[root].parent = root;
+	}
+	return profile;
+}
+
+static void
+profileFree(Profile* profile) {
+	if(profile == NULL)
+		return;
+	free(profile->trees[0].nodes);
+	free(profile->trees[1].nodes);
+	instrumentFreeNames(profile->names, profile->nameCount);
+	free(profile);
+}
+
+m3ApiRawFunction(callProfiled) {
+	ProfiledImport* import = _ctx->userdata;
+	Uw8Runtime* uw8 = import->runtime;
+	profileEnter(uw8, import->cartFunction);
+	uint64_t start = timeNanos();
+	const void* result = import->function(runtime, &import->context, _sp, _mem);
+	profileAdd(&uw8->profile->imports[uw8->profileRoot][import->index], 1, start);
+	profileLeave(uw8);
+	return result;
+}
+
+// Walks the cart's import section once and binds each function import that
+// has a native implementation. Unknown imports are left unlinked.
 void
-linkPlatformFunctions(IM3Runtime runtime, IM3Module cartMod, Z_platform_instance_t* platformInstance) {
-	for(int i = 0; i * sizeof(cPlatformFunctions[0]) < sizeof(cPlatformFunctions); ++i) {
-		m3_LinkRawFunctionEx(cartMod, "env", cPlatformFunctions[i].name, cPlatformFunctions[i].signature, cPlatformFunctions[i].function, platformInstance);
+linkImports(IM3Module cartMod, Uw8Runtime* runtime) {
+	if(runtime->profile) {
+		runtime->profiledImports = calloc(cartMod->numFuncImports + 1, sizeof(ProfiledImport));
+		runtime->profileStarts = malloc(PROFILE_MAX_DEPTH * sizeof(uint64_t));
+	}
+	for(uint32_t i = 0; i < cartMod->numFuncImports; ++i) {
+		M3ImportInfo* info = &cartMod->functions[i].import;
+		const ImportFunction* import = findImport(info->moduleUtf8, info->fieldUtf8);
+		if(import == NULL)
+			continue;
+		void* userdata = import->userdata;
+		if(userdata == NULL)
+			userdata = &runtime->platform_c;
+		else if(userdata == RUNTIME_USERDATA)
+			userdata = runtime;
+		if(runtime->profiledImports) {
+			ProfiledImport* profiled = &runtime->profiledImports[i];
+			profiled->context.userdata = userdata;
+			profiled->function = import->function;
+			profiled->runtime = runtime;
+			profiled->index = (uint32_t)(import - cImports);
+			profiled->cartFunction = i;
+			m3_LinkRawFunctionEx(cartMod, import->module, import->name, import->signature, callProfiled, profiled);
+			continue;
+		}
+		m3_LinkRawFunctionEx(cartMod, import->module, import->name, import->signature, import->function, userdata);
+	}
+	if(runtime->instrumentation && (runtime->instrumentation->flags & INSTRUMENT_CALLS)) {
+		m3_LinkRawFunctionEx(cartMod, "uw8profile", "enter", "v(i)", callProfileEnter, runtime);
+		m3_LinkRawFunctionEx(cartMod, "uw8profile", "leave", "v()", callProfileLeave, runtime);
 	}
 }
 
+#ifndef NDEBUG
+// The original wasm2c loader, kept to cross-check the native unpacker.
 void*
-loadUw8(uint32_t* sizeOut, IM3Runtime runtime, const unsigned char* uw8, size_t uw8Size) {
-	wasm_rt_memory_t memory;
-	memory.data = m3_GetMemory(runtime, NULL, 0);
-	memory.max_pages = memory.pages = 4;
-	memory.size = 4 * 65536;
+loadUw8(uint32_t* sizeOut, uint8_t* loaderMemory, const unsigned char* uw8, size_t uw8Size) {
+	struct Z_env_instance_t env = { { 0 } };
+	env.memory.data = loaderMemory;
+	env.memory.max_pages = env.memory.pages = 4;
+	env.memory.size = 4 * 65536;
 	Z_loader_instance_t loader;
-	Z_loader_instantiate(&loader, (struct Z_env_instance_t*)&memory);
+	Z_loader_instantiate(&loader, &env);
 	
-	memcpy(memory.data, uw8, uw8Size);
+	memcpy(env.memory.data, uw8, uw8Size);
 	*sizeOut = Z_loaderZ_load_uw8(&loader, (uint32_t)uw8Size);
 	void* wasm = malloc(*sizeOut);
-	memcpy(wasm, memory.data, *sizeOut);
+	memcpy(wasm, env.memory.data, *sizeOut);
 	return wasm;
 }
 
 void
-initRuntime(Uw8Runtime* runtime, IM3Environment env, void* cart, size_t cartSize) {
-	runtime->runtime = m3_NewRuntime(env, 65536, NULL);
-	runtime->runtime->memory.maxPages = 4;
-	verifyM3(runtime->runtime, ResizeMemory(runtime->runtime, 4));
+verifyUnpack(const uint8_t* cart, size_t cartSize, const uint8_t* wasm, uint32_t size) {
+	uint8_t* loaderMemory = malloc(1 << 18);
+	uint32_t expectedSize;
+	void* expected = loadUw8(&expectedSize, loaderMemory, cart, cartSize);
+	free(loaderMemory);
+	if(expectedSize != size || memcmp(expected, wasm, size) != 0)
+		log_cb(RETRO_LOG_WARN, "uw8: native unpacker differs from the reference loader\n");
+	free(expected);
+}
+#endif
+
+IM3Runtime
+newRuntime(IM3Environment env) {
+	IM3Runtime runtime = m3_NewRuntime(env, 65536, NULL);
+	runtime->memory.maxPages = 4;
+	verifyM3(runtime, ResizeMemory(runtime, 4));
+	return runtime;
+}
+
+void
+fillRuntimePool(RuntimePool* pool, IM3Environment env) {
+	while(pool->count < RUNTIME_POOL_SIZE)
+		pool->runtimes[pool->count++] = newRuntime(env);
+}
+
+IM3Runtime
+takeRuntime(RuntimePool* pool, IM3Environment env) {
+	if(pool->count == 0)
+		return newRuntime(env);
+	return pool->runtimes[--pool->count];
+}
+
+void
+freeRuntimePool(RuntimePool* pool) {
+	while(pool->count > 0)
+		m3_FreeRuntime(pool->runtimes[--pool->count]);
+}
+
+void
+initRuntime(Uw8Runtime* runtime, IM3Runtime m3Runtime, IM3Environment env, void* cart, size_t cartSize, bool lazyCompile) {
+	runtime->runtime = m3Runtime;
 
-	runtime->memory_c.data = m3_GetMemory(runtime->runtime, NULL, 0);
-	runtime->memory_c.max_pages = 4;
-	runtime->memory_c.pages = 4;
-	runtime->memory_c.size = 256*1024;
-	Z_platform_instantiate(&runtime->platform_c, (struct Z_env_instance_t*)&runtime->memory_c);
+	memset(&runtime->env_c, 0, sizeof(runtime->env_c));
+	runtime->env_c.memory.data = m3_GetMemory(runtime->runtime, NULL, 0);
+	runtime->env_c.memory.max_pages = 4;
+	runtime->env_c.memory.pages = 4;
+	runtime->env_c.memory.size = 256*1024;
+	Z_platform_instantiate(&runtime->platform_c, &runtime->env_c);
 
 	verifyM3(runtime->runtime, m3_ParseModule(env, &runtime->cart, cart, cartSize));
 	runtime->cart->memoryImported = true;
+	runtime->globalCount = runtime->instrumentation ? runtime->instrumentation->firstCounter : runtime->cart->numGlobals;
 	verifyM3(runtime->runtime, m3_LoadModule(runtime->runtime, runtime->cart));
-	linkSystemFunctions(runtime->runtime, runtime->cart);
-	linkPlatformFunctions(runtime->runtime, runtime->cart, &runtime->platform_c);
-	verifyM3(runtime->runtime, m3_CompileModule(runtime->cart));
+	linkImports(runtime->cart, runtime);
+	// wasm3 compiles any function that is still uncompiled when it is first
+	// called, so skipping this only moves the work to the first frames
+	if(!lazyCompile)
+		verifyM3(runtime->runtime, m3_CompileModule(runtime->cart));
+	uint64_t start = profileBegin(runtime);
 	verifyM3(runtime->runtime, m3_RunStart(runtime->cart));
+	if(runtime->profile)
+		profileEnd(runtime, 1, start);
 }
 
-bool
-retro_load_game(const struct retro_game_info *game)
+typedef struct AudioSetupJob {
+	AudioState* audio;
+	void* cart;
+	uint32_t cartSize;
+	bool lazyCompile;
+	uint64_t micros;
+} AudioSetupJob;
+
+void
+setupAudioRuntime(void* arg) {
+	AudioSetupJob* job = arg;
+	AudioState* audio = job->audio;
+	uint64_t start = timeMicros();
+	initRuntime(&audio->runtime, takeRuntime(&audio->pool, audio->env), audio->env, job->cart, job->cartSize, job->lazyCompile);
+	job->micros = timeMicros() - start;
+}
+
+// Captures what start() left behind besides the memory contents, so that
+// a reset can return to it.
+void
+saveInitialState(Uw8Runtime* runtime) {
+	runtime->initialPlatform = runtime->platform_c;
+	memcpy(runtime->initialReserved, runtime->env_c.reservedGlobals, sizeof(runtime->initialReserved));
+	IM3Module cart = runtime->cart;
+	runtime->initialGlobals = calloc(runtime->globalCount + 1, sizeof(M3TaggedValue));
+	for(uint32_t i = 0; i < runtime->globalCount; ++i)
+		m3_GetGlobal(&cart->globals[i], &runtime->initialGlobals[i]);
+}
+
+void
+restoreInitialState(Uw8Runtime* runtime, MemImage* image) {
+	memImageRestore(image, runtime->env_c.memory.data, runtime->memoryMapped);
+	runtime->platform_c = runtime->initialPlatform;
+	memcpy(runtime->env_c.reservedGlobals, runtime->initialReserved, sizeof(runtime->initialReserved));
+	IM3Module cart = runtime->cart;
+	for(uint32_t i = 0; i < runtime->globalCount; ++i)
+		m3_SetGlobal(&cart->globals[i], &runtime->initialGlobals[i]); // fails harmlessly for immutable globals
+}
+
+void
+attachInitialMemory(Uw8Runtime* runtime, MemImage* image) {
+	runtime->memoryMapped = memImageAttach(image, runtime->runtime);
+	runtime->env_c.memory.data = m3_GetMemory(runtime->runtime, NULL, 0);
+}
+
+void
+releaseRuntime(Uw8Runtime* runtime, MemImage* image) {
+	if(runtime->runtime == NULL)
+		return;
+	if(runtime->memoryMapped)
+		memImageDetach(image, runtime->runtime);
+	m3_FreeRuntime(runtime->runtime);
+	runtime->runtime = NULL;
+	runtime->memoryMapped = false;
+	free(runtime->initialGlobals);
+	runtime->initialGlobals = NULL;
+	free(runtime->profiledImports);
+	runtime->profiledImports = NULL;
+	free(runtime->profileStarts);
+	runtime->profileStarts = NULL;
+	runtime->profile = NULL;
+	runtime->profileTree = NULL;
+}
+
+void
+logPeakMemory(void)
 {
-	enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+#if !defined(_WIN32)
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+		long peakKiB = (long)(usage.ru_maxrss / 1024);
+#else
+		long peakKiB = (long)usage.ru_maxrss;
+#endif
+		log_cb(RETRO_LOG_INFO, "uw8: peak RSS %ld KiB\n", peakKiB);
+	}
+#endif
+}
+
+static const uint8_t retro_bind[] = {
+	[RETRO_DEVICE_ID_JOYPAD_UP] = 1<<0,
+	[RETRO_DEVICE_ID_JOYPAD_DOWN] = 1<<1,
+	[RETRO_DEVICE_ID_JOYPAD_LEFT] = 1<<2,
+	[RETRO_DEVICE_ID_JOYPAD_RIGHT] = 1<<3,
+	[RETRO_DEVICE_ID_JOYPAD_B] = 1<<4,
+	[RETRO_DEVICE_ID_JOYPAD_A] = 1<<5,
+	[RETRO_DEVICE_ID_JOYPAD_Y] = 1<<6,
+	[RETRO_DEVICE_ID_JOYPAD_X] = 1<<7,
+};
+
+// MicroW8 button bits for the low and high byte of a
+// RETRO_DEVICE_ID_JOYPAD_MASK result
+static uint8_t maskToButtonsLow[256];
+static uint8_t maskToButtonsHigh[256];
+static bool inputBitmasks;
+static unsigned portDevices[4] = {
+	RETRO_DEVICE_JOYPAD, RETRO_DEVICE_JOYPAD, RETRO_DEVICE_JOYPAD, RETRO_DEVICE_JOYPAD
+};
+
+void
+initInputTables(void) {
+	for(unsigned mask = 0; mask < 256; ++mask) {
+		uint8_t low = 0, high = 0;
+		for(unsigned id = 0; id < 8; ++id) {
+			if(!(mask & (1 << id)))
+				continue;
+			if(id < sizeof(retro_bind))
+				low |= retro_bind[id];
+			if(id + 8 < sizeof(retro_bind))
+				high |= retro_bind[id + 8];
+		}
+		maskToButtonsLow[mask] = low;
+		maskToButtonsHigh[mask] = high;
+	}
+}
+
+uint8_t
+readButtons(unsigned port) {
+	if(inputBitmasks) {
+		unsigned mask = (unsigned)input_state_cb(port, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_MASK);
+		return maskToButtonsLow[mask & 0xff] | maskToButtonsHigh[(mask >> 8) & 0xff];
+	}
+
+	uint8_t buttons = 0;
+	for(unsigned id = 0; id < sizeof(retro_bind); id++)
+		if(input_state_cb(port, RETRO_DEVICE_JOYPAD, 0, id))
+			buttons |= retro_bind[id];
+	return buttons;
+}
+
+// Shared by all instances: the wasm2c runtime and the modules' function
+// types are set up once, the unpacker's base module is kept while any
+// instance exists.
+#if defined(HAVE_THREADS)
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static bool runtimeReady;
+static uint32_t coreCount;
+
+static void
+acquireShared(void) {
+#if defined(HAVE_THREADS)
+	pthread_mutex_lock(&sharedLock);
+#endif
+	if(!runtimeReady) {
+		wasm_rt_init();
+		Z_loader_init_module();
+		Z_platform_init_module();
+		if(!buildImportTable()) {
+			// only possible after cImports grew, IMPORT_SLOTS has to grow with it
+			log_cb(RETRO_LOG_ERROR, "uw8: no perfect hash for the %u imports\n", (unsigned)IMPORT_COUNT);
+			abort();
+		}
+		runtimeReady = true;
+	}
+	if(coreCount++ == 0)
+		unpackInit();
+#if defined(HAVE_THREADS)
+	pthread_mutex_unlock(&sharedLock);
+#endif
+}
+
+static void
+releaseShared(void) {
+#if defined(HAVE_THREADS)
+	pthread_mutex_lock(&sharedLock);
+#endif
+	if(--coreCount == 0)
+		unpackFree();
+#if defined(HAVE_THREADS)
+	pthread_mutex_unlock(&sharedLock);
+#endif
+}
+
+#if UW8_OP_PAIRS
+// Executions of adjacent opcode pairs, indexed by first * INSTRUMENT_OPS +
+// second, summed up over all runtimes of all instances when their cart is
+// unloaded. Each counter increment costs a global.get, i64.const, i64.add
+// and global.set, which is why this is a build of its own.
+static uint64_t* opPairCounts;
+static uint64_t opPairIncrements;
+
+static void
+countOpPairs(Uw8Runtime* runtime) {
+	const Instrumentation* info = runtime->instrumentation;
+	if(runtime->runtime == NULL || info == NULL)
+		return;
+#if defined(HAVE_THREADS)
+	pthread_mutex_lock(&sharedLock);
+#endif
+	if(opPairCounts == NULL)
+		opPairCounts = calloc(INSTRUMENT_OPS * INSTRUMENT_OPS, sizeof(uint64_t));
+	IM3Module cart = runtime->cart;
+	M3TaggedValue count;
+	for(uint32_t i = 0; i < info->blockCount; ++i)
+		if(m3_GetGlobal(&cart->globals[info->firstCounter + i], &count) == NULL)
+			opPairIncrements += count.value.i64;
+	for(uint32_t i = 0; opPairCounts && i < info->pairCount; ++i) {
+		const OpPair* pair = &info->pairs[i];
+		if(m3_GetGlobal(&cart->globals[info->firstCounter + pair->block], &count) == NULL)
+			opPairCounts[pair->first * INSTRUMENT_OPS + pair->second] += count.value.i64;
+	}
+#if defined(HAVE_THREADS)
+	pthread_mutex_unlock(&sharedLock);
+#endif
+}
+
+static int
+compareOpPairs(const void* a, const void* b) {
+	uint64_t countA = opPairCounts[*(const uint32_t*)a];
+	uint64_t countB = opPairCounts[*(const uint32_t*)b];
+	return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+// "count first+second" lines, most frequent first, in the format of
+// m3_PrintProfilerInfo so that the same awk line sums up a corpus
+static void
+printOpPairs(void) {
+	if(opPairCounts == NULL)
+		return;
+	uint32_t* order = malloc(INSTRUMENT_OPS * INSTRUMENT_OPS * sizeof(uint32_t));
+	uint32_t count = 0;
+	for(uint32_t i = 0; order && i < INSTRUMENT_OPS * INSTRUMENT_OPS; ++i)
+		if(opPairCounts[i])
+			order[count++] = i;
+	if(order)
+		qsort(order, count, sizeof(uint32_t), compareOpPairs);
+	printf("%llu counter_increments\n", (unsigned long long)opPairIncrements);
+	for(uint32_t i = 0; i < count; ++i)
+		printf("%llu %s+%s\n", (unsigned long long)opPairCounts[order[i]],
+			instrumentOpName(order[i] / INSTRUMENT_OPS), instrumentOpName(order[i] % INSTRUMENT_OPS));
+	free(order);
+	free(opPairCounts);
+	opPairCounts = NULL;
+	opPairIncrements = 0;
+}
+#endif
+
+Uw8Core*
+uw8Create(void) {
+	Uw8Core* core = calloc(1, sizeof(Uw8Core));
+	if(core == NULL)
+		return NULL;
+	acquireShared();
+
+	core->game.env = m3_NewEnvironment();
+	fillRuntimePool(&core->game.pool, core->game.env);
+	core->audio.env = m3_NewEnvironment();
+	fillRuntimePool(&core->audio.pool, core->audio.env);
+	return core;
+}
+
+void
+uw8Destroy(Uw8Core* core) {
+	if(core == NULL)
+		return;
+	uw8Unload(core);
+	freeRuntimePool(&core->game.pool);
+	m3_FreeEnvironment(core->game.env);
+	freeRuntimePool(&core->audio.pool);
+	m3_FreeEnvironment(core->audio.env);
+	profileFree(core->profile);
+	workerDestroy(core->loadWorker);
+	free(core);
+	releaseShared();
+}
+
+bool
+uw8Load(Uw8Core* core, const uint8_t* cart, size_t cartSize, bool lazyCompile) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	game->lazyCompile = lazyCompile;
+	profileFree(core->profile);
+	core->profile = core->profiling ? profileCreate() : NULL;
+	Profile* profile = core->profile;
+	game->runtime.profile = profile;
+	game->runtime.profileTree = profile ? &profile->trees[0] : NULL;
+	game->runtime.profileRoot = PROFILE_GAME_START;
+	audio->runtime.profile = profile;
+	audio->runtime.profileTree = profile ? &profile->trees[1] : NULL;
+	audio->runtime.profileRoot = PROFILE_AUDIO_START;
+
+	uint64_t start = timeMicros();
+	uint32_t wasmSize;
+	void* cartWasm = unpackUw8(cart, cartSize, &wasmSize);
+	if(cartWasm == NULL) {
+		log_cb(RETRO_LOG_ERROR, "uw8: malformed cart\n");
+		return false;
+	}
+#ifndef NDEBUG
+	verifyUnpack(cart, cartSize, cartWasm, wasmSize);
+#endif
+	game->cartWasm = cartWasm;
+	game->cartWasmSize = wasmSize;
+	game->moduleHash = uw8Hash(cartWasm, wasmSize);
+	game->moduleWasm = cartWasm;
+	uint32_t moduleSize = wasmSize;
+	game->runtime.instrumentation = NULL;
+	audio->runtime.instrumentation = NULL;
+	unsigned instrumentFlags = profile ? INSTRUMENT_CALLS : 0;
+#if UW8_OP_PAIRS
+	instrumentFlags |= INSTRUMENT_BLOCKS;
+#endif
+	if(profile)
+		profile->names = instrumentFunctionNames(cartWasm, wasmSize, &profile->nameCount);
+	uint8_t* instrumented = NULL;
+	if(instrumentFlags)
+		instrumented = instrumentModule(cartWasm, wasmSize, instrumentFlags, &game->instrumentation, &moduleSize);
+	if(instrumented) {
+		game->moduleWasm = instrumented;
+		game->runtime.instrumentation = &game->instrumentation;
+		audio->runtime.instrumentation = &game->instrumentation;
+	} else if(instrumentFlags) {
+		moduleSize = wasmSize;
+		log_cb(RETRO_LOG_WARN, "uw8: cart could not be instrumented, only its entry points and imports are profiled\n");
+	}
+	uint64_t unpackEnd = timeMicros();
+
+	// start() is deterministic, so the audio runtime is set up on a worker
+	// while the game runtime runs its start(), and ends up with the same
+	// memory image
+	AudioSetupJob audioSetup = { audio, game->moduleWasm, moduleSize, lazyCompile, 0 };
+#if !d_m3EnableOpProfiling // wasm3's operation counters are not thread-safe
+	if(core->loadWorker == NULL)
+		core->loadWorker = workerCreate();
+#endif
+	Worker* loadWorker = core->loadWorker;
+	if(loadWorker)
+		workerStart(loadWorker, setupAudioRuntime, &audioSetup);
+	else
+		setupAudioRuntime(&audioSetup);
+
+	initRuntime(&game->runtime, takeRuntime(&game->pool, game->env), game->env, game->moduleWasm, moduleSize, lazyCompile);
+	uint64_t gameEnd = timeMicros();
+
+	bool imageOk = memImageInit(&game->initialMemory, game->runtime.env_c.memory.data, 1 << 18);
+	uint64_t imageEnd = timeMicros();
+	if(loadWorker)
+		workerWait(loadWorker);
+	if(!imageOk) {
+		uw8Unload(core);
 		return false;
+	}
+	attachInitialMemory(&game->runtime, &game->initialMemory);
+	saveInitialState(&game->runtime);
+	game->runtime.profileRoot = PROFILE_UPD;
+	audio->runtime.profileRoot = PROFILE_SND;
+
+	game->memory = m3_GetMemory(game->runtime.runtime, NULL, 0);
+	assert(game->memory != NULL);
+
+	game->hasUpdFunc = m3_FindFunction(&game->updFunc, game->runtime.runtime, "upd") == NULL;
+
+	// the audio runtime shares the unmodified pages of the game's image
+	attachInitialMemory(&audio->runtime, &game->initialMemory);
+	saveInitialState(&audio->runtime);
+	audio->memory = m3_GetMemory(audio->runtime.runtime, NULL, 0);
+	audio->hasSnd = m3_FindFunction(&audio->snd, audio->runtime.runtime, "snd") == NULL;
+	memcpy(audio->registers, audio->memory + 0x50, 32);
+	audio->sampleIndex = 0;
+	game->frameNumber = 0;
+
+	log_cb(RETRO_LOG_INFO, "uw8: cart loaded in %.2f ms (%s compilation)\n",
+		(timeMicros() - start) / 1000.0, lazyCompile ? "lazy" : "eager");
+	log_cb(RETRO_LOG_DEBUG, "uw8: load stages: unpack %.2f ms, game runtime %.2f ms, initial image %.2f ms, audio runtime %.2f ms (parallel)\n",
+		(unpackEnd - start) / 1000.0, (gameEnd - unpackEnd) / 1000.0,
+		(imageEnd - gameEnd) / 1000.0, audioSetup.micros / 1000.0);
+	return true;
+}
+
+void
+uw8Unload(Uw8Core* core) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	if(game->runtime.runtime == NULL)
+		return;
+
+#if UW8_OP_PAIRS
+	countOpPairs(&audio->runtime);
+	countOpPairs(&game->runtime);
+#endif
+	releaseRuntime(&audio->runtime, &game->initialMemory);
+	releaseRuntime(&game->runtime, &game->initialMemory);
+	memImageFree(&game->initialMemory);
+	if(game->moduleWasm != game->cartWasm)
+		free(game->moduleWasm);
+	game->moduleWasm = NULL;
+	instrumentationFree(&game->instrumentation);
+	free(game->cartWasm);
+	game->cartWasm = NULL;
+	game->memory = NULL;
+	audio->memory = NULL;
+
+	// pre-warm the runtimes for the next cart
+	fillRuntimePool(&game->pool, game->env);
+	fillRuntimePool(&audio->pool, audio->env);
+}
+
+void
+uw8Reset(Uw8Core* core) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	restoreInitialState(&game->runtime, &game->initialMemory);
+	restoreInitialState(&audio->runtime, &game->initialMemory);
+	memcpy(audio->registers, audio->memory + 0x50, 32);
+	audio->sampleIndex = 0;
+	game->frameNumber = 0;
+}
 
-	gameState->pixels32 = malloc(320*240*4);
+void
+uw8RunFrame(Uw8Core* core, const uint8_t buttons[4]) {
+	GameState* game = &core->game;
+	memcpy(game->memory + 0x00044, buttons, 4);
+
+	if(game->hasUpdFunc) {
+		uint64_t start = profileBegin(&game->runtime);
+		verifyM3(game->runtime.runtime, m3_CallV(game->updFunc));
+		if(game->runtime.profile)
+			profileEnd(&game->runtime, 1, start);
+	}
+	memcpy(core->audio.registers, game->memory + 0x50, 32);
 
-	wasm_rt_init();
-	Z_loader_init_module();
-	Z_platform_init_module();
+	Z_platformZ_endFrame(&game->runtime.platform_c);
 
-	gameState->env = m3_NewEnvironment();
-	IM3Runtime loaderRuntime = m3_NewRuntime(gameState->env, 65536, NULL);
-	loaderRuntime->memory.maxPages = 4;
-	verifyM3(loaderRuntime, ResizeMemory(loaderRuntime, 4));
+	// nothing reads the time before the next upd(), so the frame can be
+	// resolved after this
+	*(uint32_t*)&game->memory[0x00040] = game->frameNumber++ * 1000 / 60 + 8;
+}
 
-	uint32_t cartSize;
-	void* cartWasm = loadUw8(&cartSize, loaderRuntime, game->data, game->size);
+void
+uw8RenderAudio(Uw8Core* core, int16_t* samples) {
+	AudioState* audio = &core->audio;
+	memcpy(audio->memory + 0x50, audio->registers, 32);
+	uint64_t start = profileBegin(&audio->runtime);
+	for(int i = 0; i < UW8_SAMPLES_PER_FRAME; ++i) {
+		float_t left, right;
+		if(audio->hasSnd) {
+			m3_CallV(audio->snd, audio->sampleIndex++);
+			m3_GetResultsV(audio->snd, &left);
+			m3_CallV(audio->snd, audio->sampleIndex++);
+			m3_GetResultsV(audio->snd, &right);
+		} else {
+			left = Z_platformZ_sndGes(&audio->runtime.platform_c, audio->sampleIndex++);
+			right = Z_platformZ_sndGes(&audio->runtime.platform_c, audio->sampleIndex++);
+		}
+		*samples++ = (int16_t)(left * 32767.0f);
+		*samples++ = (int16_t)(right * 32767.0f);
+	}
+	if(audio->runtime.profile && audio->hasSnd)
+		profileEnd(&audio->runtime, UW8_SAMPLES_PER_FRAME * 2, start);
+}
+
+void
+uw8SetProfiling(Uw8Core* core, bool enabled) {
+	core->profiling = enabled;
+}
+
+// The node's path from its entry point, "game;upd;drawPlayer;circle"
+static void
+writeProfilePath(FILE* file, const Profile* profile, const ProfileTree* tree, uint32_t node) {
+	if(node < PROFILE_ROOTS) {
+		fputs(profileRootNames[node], file);
+		return;
+	}
+	writeProfilePath(file, profile, tree, tree->nodes[node].parent);
+	uint32_t function = tree->nodes[node].function;
+	const char* name = function < profile->nameCount ? profile->names[function] : NULL;
+	if(name == NULL) {
+		fprintf(file, ";func%u", function);
+		return;
+	}
+	fputc(';', file);
+	for(; *name; ++name)
+		fputc(*name == ';' || *name == '\n' ? '_' : *name, file);
+}
+
+// Collapsed stacks as read by flamegraph.pl and speedscope, in
+// microseconds. Each line is the time of a call path outside of the
+// calls it makes.
+bool
+uw8WriteProfile(Uw8Core* core, const char* path) {
+	Profile* profile = core->profile;
+	if(profile == NULL)
+		return false;
+	FILE* file = fopen(path, "w");
+	if(file == NULL)
+		return false;
+	for(uint32_t t = 0; t < 2; ++t) {
+		const ProfileTree* tree = &profile->trees[t];
+		for(uint32_t node = 0; node < tree->count; ++node) {
+			const ProfileNode* entry = &tree->nodes[node];
+			if(entry->stats.calls == 0)
+				continue;
+			uint64_t childNanos = 0;
+			for(uint32_t child = entry->firstChild; child; child = tree->nodes[child].nextSibling)
+				childNanos += tree->nodes[child].stats.nanos;
+			uint64_t nanos = entry->stats.nanos;
+			writeProfilePath(file, profile, tree, node);
+			fprintf(file, " %llu\n", (unsigned long long)((nanos > childNanos ? nanos - childNanos : 0) / 1000));
+		}
+	}
+	return fclose(file) == 0;
+}
+
+uint8_t*
+uw8Memory(Uw8Core* core) {
+	return core->game.memory;
+}
+
+uint64_t
+uw8Hash(const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+// Saved states keep only the pages that differ from the initial image,
+// which for most carts is a small part of the 256 KiB.
+#define STATE_PAGE_SIZE 4096
+#define STATE_PAGES (UW8_MEMORY_SIZE / STATE_PAGE_SIZE)
+
+typedef struct RuntimeState {
+	Z_platform_instance_t platform; // only the globals are used
+	u32 reservedGlobals[16];
+	uint32_t globalCount;
+	M3TaggedValue* globals;
+	uint64_t dirtyPages; // bit n: page n differs from the initial image
+	uint8_t* pages; // the dirty pages in order
+} RuntimeState;
+
+struct Uw8State {
+	uint64_t moduleHash;
+	RuntimeState game;
+	RuntimeState audio;
+	uint8_t registers[32];
+	uint32_t sampleIndex;
+	uint32_t frameNumber;
+};
+
+// The platform instance also holds pointers into its runtime, which must
+// survive when a state moves to another instance.
+static void
+copyPlatformGlobals(Z_platform_instance_t* to, const Z_platform_instance_t* from) {
+	to->w2c_g0 = from->w2c_g0;
+	to->w2c_g1 = from->w2c_g1;
+	to->w2c_g2 = from->w2c_g2;
+	to->w2c_g3 = from->w2c_g3;
+	to->w2c_g4 = from->w2c_g4;
+	to->w2c_g5 = from->w2c_g5;
+	to->w2c_g6 = from->w2c_g6;
+}
+
+// g0 (the random state) as u64, g1 to g6 and the reserved globals as u32
+#define PLATFORM_GLOBALS_SIZE (8 + 6 * 4 + 16 * 4)
+
+static uint8_t*
+writePlatformGlobals(uint8_t* out, const Z_platform_instance_t* platform, const u32* reservedGlobals) {
+	out = putLe(out, platform->w2c_g0, 8);
+	out = putLe(out, platform->w2c_g1, 4);
+	out = putLe(out, platform->w2c_g2, 4);
+	out = putLe(out, platform->w2c_g3, 4);
+	out = putLe(out, platform->w2c_g4, 4);
+	out = putLe(out, platform->w2c_g5, 4);
+	out = putLe(out, platform->w2c_g6, 4);
+	for(uint32_t i = 0; i < 16; ++i)
+		out = putLe(out, reservedGlobals[i], 4);
+	return out;
+}
+
+static const uint8_t*
+readPlatformGlobals(const uint8_t* in, Z_platform_instance_t* platform, u32* reservedGlobals) {
+	platform->w2c_g0 = getLe(in, 8);
+	platform->w2c_g1 = (u32)getLe(in + 8, 4);
+	platform->w2c_g2 = (u32)getLe(in + 12, 4);
+	platform->w2c_g3 = (u32)getLe(in + 16, 4);
+	platform->w2c_g4 = (u32)getLe(in + 20, 4);
+	platform->w2c_g5 = (u32)getLe(in + 24, 4);
+	platform->w2c_g6 = (u32)getLe(in + 28, 4);
+	for(uint32_t i = 0; i < 16; ++i)
+		reservedGlobals[i] = (u32)getLe(in + 32 + 4 * i, 4);
+	return in + PLATFORM_GLOBALS_SIZE;
+}
+
+// A cart global's value as 64 bits, with i32 and f32 in the low half
+static uint64_t
+globalBits(const M3TaggedValue* value) {
+	uint32_t bits32;
+	uint64_t bits64;
+	switch(value->type) {
+	case c_m3Type_i32:
+		return value->value.i32;
+	case c_m3Type_i64:
+		return value->value.i64;
+	case c_m3Type_f32:
+		memcpy(&bits32, &value->value.f32, 4);
+		return bits32;
+	case c_m3Type_f64:
+		memcpy(&bits64, &value->value.f64, 8);
+		return bits64;
+	default:
+		return 0;
+	}
+}
+
+static void
+setGlobalBits(M3TaggedValue* value, uint64_t bits) {
+	uint32_t bits32 = (uint32_t)bits;
+	switch(value->type) {
+	case c_m3Type_i32:
+		value->value.i32 = bits32;
+		break;
+	case c_m3Type_i64:
+		value->value.i64 = bits;
+		break;
+	case c_m3Type_f32:
+		memcpy(&value->value.f32, &bits32, 4);
+		break;
+	case c_m3Type_f64:
+		memcpy(&value->value.f64, &bits, 8);
+		break;
+	default:
+		break;
+	}
+}
+
+static bool
+saveRuntimeState(RuntimeState* state, Uw8Runtime* runtime, const uint8_t* image) {
+	const uint8_t* memory = runtime->env_c.memory.data;
+	uint32_t dirtyCount = 0;
+	state->dirtyPages = 0;
+	for(uint32_t page = 0; page < STATE_PAGES; ++page) {
+		size_t offset = (size_t)page * STATE_PAGE_SIZE;
+		if(image == NULL || memcmp(memory + offset, image + offset, STATE_PAGE_SIZE) != 0) {
+			state->dirtyPages |= 1ull << page;
+			++dirtyCount;
+		}
+	}
+	state->pages = malloc((size_t)dirtyCount * STATE_PAGE_SIZE + 1);
+	IM3Module cart = runtime->cart;
+	state->globalCount = runtime->globalCount;
+	state->globals = calloc(runtime->globalCount + 1, sizeof(M3TaggedValue));
+	if(state->pages == NULL || state->globals == NULL)
+		return false;
+
+	uint8_t* out = state->pages;
+	for(uint32_t page = 0; page < STATE_PAGES; ++page) {
+		if(state->dirtyPages & (1ull << page)) {
+			memcpy(out, memory + (size_t)page * STATE_PAGE_SIZE, STATE_PAGE_SIZE);
+			out += STATE_PAGE_SIZE;
+		}
+	}
+	copyPlatformGlobals(&state->platform, &runtime->platform_c);
+	memcpy(state->reservedGlobals, runtime->env_c.reservedGlobals, sizeof(state->reservedGlobals));
+	for(uint32_t i = 0; i < runtime->globalCount; ++i)
+		m3_GetGlobal(&cart->globals[i], &state->globals[i]);
+	return true;
+}
+
+static void
+loadRuntimeState(Uw8Runtime* runtime, const RuntimeState* state, MemImage* image) {
+	uint8_t* memory = runtime->env_c.memory.data;
+	memImageRestore(image, memory, runtime->memoryMapped);
+	const uint8_t* in = state->pages;
+	for(uint32_t page = 0; page < STATE_PAGES; ++page) {
+		if(state->dirtyPages & (1ull << page)) {
+			memcpy(memory + (size_t)page * STATE_PAGE_SIZE, in, STATE_PAGE_SIZE);
+			in += STATE_PAGE_SIZE;
+		}
+	}
+	copyPlatformGlobals(&runtime->platform_c, &state->platform);
+	memcpy(runtime->env_c.reservedGlobals, state->reservedGlobals, sizeof(state->reservedGlobals));
+	IM3Module cart = runtime->cart;
+	for(uint32_t i = 0; i < state->globalCount; ++i)
+		m3_SetGlobal(&cart->globals[i], &state->globals[i]); // fails harmlessly for immutable globals
+}
+
+static void
+freeRuntimeState(RuntimeState* state) {
+	free(state->pages);
+	free(state->globals);
+}
+
+void
+uw8StateFree(Uw8State* state) {
+	if(state == NULL)
+		return;
+	freeRuntimeState(&state->game);
+	freeRuntimeState(&state->audio);
+	free(state);
+}
+
+Uw8State*
+uw8StateSave(Uw8Core* core) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	if(game->runtime.runtime == NULL)
+		return NULL;
+	Uw8State* state = calloc(1, sizeof(Uw8State));
+	if(state == NULL)
+		return NULL;
+	const uint8_t* image = memImageContents(&game->initialMemory);
+	if(!saveRuntimeState(&state->game, &game->runtime, image) || !saveRuntimeState(&state->audio, &audio->runtime, image)) {
+		uw8StateFree(state);
+		return NULL;
+	}
+	state->moduleHash = game->moduleHash;
+	memcpy(state->registers, audio->registers, 32);
+	state->sampleIndex = audio->sampleIndex;
+	state->frameNumber = game->frameNumber;
+	return state;
+}
+
+bool
+uw8StateLoad(Uw8Core* core, const Uw8State* state) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	// states read from bytes may be damaged despite the right hash
+	if(game->runtime.runtime == NULL || state->moduleHash != game->moduleHash
+			|| state->game.globalCount != game->runtime.globalCount
+			|| state->audio.globalCount != audio->runtime.globalCount)
+		return false;
+	loadRuntimeState(&game->runtime, &state->game, &game->initialMemory);
+	loadRuntimeState(&audio->runtime, &state->audio, &game->initialMemory);
+	memcpy(audio->registers, state->registers, 32);
+	audio->sampleIndex = state->sampleIndex;
+	game->frameNumber = state->frameNumber;
+	return true;
+}
+
+Uw8Core*
+uw8Clone(Uw8Core* core) {
+	GameState* game = &core->game;
+	Uw8State* state = uw8StateSave(core);
+	if(state == NULL)
+		return NULL;
+	// the unpacked module is a plain wasm cart of its own
+	Uw8Core* clone = uw8Create();
+	if(clone && !(uw8Load(clone, game->cartWasm, game->cartWasmSize, game->lazyCompile) && uw8StateLoad(clone, state))) {
+		uw8Destroy(clone);
+		clone = NULL;
+	}
+	uw8StateFree(state);
+	return clone;
+}
+
+// Saved states as bytes, e.g. for keyframes in movies. Like serialized
+// states these are little-endian with fixed widths.
+#define STATE_HEADER_SIZE (8 + 32 + 4 + 4)
+#define STATE_GLOBAL_SIZE (1 + 8) // type, then the bits from globalBits
+
+static size_t
+writeRuntimeState(uint8_t* out, const RuntimeState* state) {
+	size_t pageCount = 0;
+	for(uint32_t page = 0; page < STATE_PAGES; ++page)
+		pageCount += (state->dirtyPages >> page) & 1;
+	size_t size = PLATFORM_GLOBALS_SIZE + 4 + (size_t)state->globalCount * STATE_GLOBAL_SIZE
+		+ 8 + pageCount * STATE_PAGE_SIZE;
+	if(out == NULL)
+		return size;
+	out = writePlatformGlobals(out, &state->platform, state->reservedGlobals);
+	out = putLe(out, state->globalCount, 4);
+	for(uint32_t i = 0; i < state->globalCount; ++i) {
+		*out++ = (uint8_t)state->globals[i].type;
+		out = putLe(out, globalBits(&state->globals[i]), 8);
+	}
+	out = putLe(out, state->dirtyPages, 8);
+	memcpy(out, state->pages, pageCount * STATE_PAGE_SIZE);
+	return size;
+}
+
+static bool
+take(const uint8_t** in, const uint8_t* end, void* data, size_t size) {
+	if((size_t)(end - *in) < size)
+		return false;
+	memcpy(data, *in, size);
+	*in += size;
+	return true;
+}
+
+static bool
+readRuntimeState(RuntimeState* state, const uint8_t** in, const uint8_t* end) {
+	if((size_t)(end - *in) < PLATFORM_GLOBALS_SIZE + 4)
+		return false;
+	*in = readPlatformGlobals(*in, &state->platform, state->reservedGlobals);
+	state->globalCount = (uint32_t)getLe(*in, 4);
+	*in += 4;
+	if(state->globalCount > (size_t)(end - *in) / STATE_GLOBAL_SIZE)
+		return false;
+	state->globals = calloc(state->globalCount + 1, sizeof(M3TaggedValue));
+	if(state->globals == NULL)
+		return false;
+	for(uint32_t i = 0; i < state->globalCount; ++i) {
+		state->globals[i].type = (M3ValueType)**in;
+		setGlobalBits(&state->globals[i], getLe(*in + 1, 8));
+		*in += STATE_GLOBAL_SIZE;
+	}
+	if((size_t)(end - *in) < 8)
+		return false;
+	state->dirtyPages = getLe(*in, 8);
+	*in += 8;
+	size_t pageCount = 0;
+	for(uint32_t page = 0; page < STATE_PAGES; ++page)
+		pageCount += (state->dirtyPages >> page) & 1;
+	state->pages = malloc(pageCount * STATE_PAGE_SIZE + 1);
+	return state->pages && take(in, end, state->pages, pageCount * STATE_PAGE_SIZE);
+}
+
+size_t
+uw8StateSize(const Uw8State* state) {
+	return STATE_HEADER_SIZE + writeRuntimeState(NULL, &state->game) + writeRuntimeState(NULL, &state->audio);
+}
+
+void
+uw8StateWrite(const Uw8State* state, void* data) {
+	uint8_t* out = data;
+	out = putLe(out, state->moduleHash, 8);
+	memcpy(out, state->registers, 32);
+	out += 32;
+	out = putLe(out, state->sampleIndex, 4);
+	out = putLe(out, state->frameNumber, 4);
+	out += writeRuntimeState(out, &state->game);
+	writeRuntimeState(out, &state->audio);
+}
+
+Uw8State*
+uw8StateRead(const void* data, size_t size) {
+	const uint8_t* in = data;
+	const uint8_t* end = in + size;
+	if(size < STATE_HEADER_SIZE)
+		return NULL;
+	Uw8State* state = calloc(1, sizeof(Uw8State));
+	if(state == NULL)
+		return NULL;
+	state->moduleHash = getLe(in, 8);
+	memcpy(state->registers, in + 8, 32);
+	state->sampleIndex = (uint32_t)getLe(in + 40, 4);
+	state->frameNumber = (uint32_t)getLe(in + 44, 4);
+	in += STATE_HEADER_SIZE;
+	if(!readRuntimeState(&state->game, &in, end) || !readRuntimeState(&state->audio, &in, end)) {
+		uw8StateFree(state);
+		return NULL;
+	}
+	return state;
+}
+
+uint64_t
+uw8RandomState(Uw8Core* core) {
+	return core->game.runtime.platform_c.w2c_g0;
+}
+
+// Serialized states are always complete: both memories, the platform and
+// reserved globals and the cart's own globals of both runtimes.
+#define SERIAL_MAGIC 0x53385755 // "UW8S"
+#define SERIAL_FORMAT 2
 
-	m3_FreeRuntime(loaderRuntime);
+// magic, format, module hash, frame number, sample index, sound registers
+#define SERIAL_HEADER_SIZE (4 + 4 + 8 + 4 + 4 + 32)
 
-	initRuntime(&gameState->runtime, gameState->env, cartWasm, cartSize);
+// Memory, platform globals, then each cart global as 8 bytes. The size
+// only depends on the cart.
+static size_t
+serialRuntimeSize(Uw8Runtime* runtime) {
+	return UW8_MEMORY_SIZE + PLATFORM_GLOBALS_SIZE + (size_t)runtime->globalCount * 8;
+}
+
+static uint8_t*
+serializeRuntime(uint8_t* out, Uw8Runtime* runtime) {
+	memcpy(out, runtime->env_c.memory.data, UW8_MEMORY_SIZE);
+	out += UW8_MEMORY_SIZE;
+	out = writePlatformGlobals(out, &runtime->platform_c, runtime->env_c.reservedGlobals);
+	IM3Module cart = runtime->cart;
+	for(uint32_t i = 0; i < runtime->globalCount; ++i) {
+		M3TaggedValue value;
+		m3_GetGlobal(&cart->globals[i], &value);
+		out = putLe(out, globalBits(&value), 8);
+	}
+	return out;
+}
+
+static const uint8_t*
+unserializeRuntime(const uint8_t* in, Uw8Runtime* runtime) {
+	memcpy(runtime->env_c.memory.data, in, UW8_MEMORY_SIZE);
+	in += UW8_MEMORY_SIZE;
+	in = readPlatformGlobals(in, &runtime->platform_c, runtime->env_c.reservedGlobals);
+	IM3Module cart = runtime->cart;
+	for(uint32_t i = 0; i < runtime->globalCount; ++i) {
+		M3TaggedValue value;
+		m3_GetGlobal(&cart->globals[i], &value); // for the type
+		setGlobalBits(&value, getLe(in, 8));
+		m3_SetGlobal(&cart->globals[i], &value);
+		in += 8;
+	}
+	return in;
+}
+
+size_t
+uw8SerializeSize(Uw8Core* core) {
+	if(core->game.runtime.runtime == NULL)
+		return 0;
+	return SERIAL_HEADER_SIZE + serialRuntimeSize(&core->game.runtime) + serialRuntimeSize(&core->audio.runtime);
+}
+
+bool
+uw8Serialize(Uw8Core* core, void* data, size_t size) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	if(size < uw8SerializeSize(core) || game->runtime.runtime == NULL)
+		return false;
+	uint8_t* out = data;
+	out = putLe(out, SERIAL_MAGIC, 4);
+	out = putLe(out, SERIAL_FORMAT, 4);
+	out = putLe(out, game->moduleHash, 8);
+	out = putLe(out, game->frameNumber, 4);
+	out = putLe(out, audio->sampleIndex, 4);
+	memcpy(out, audio->registers, 32);
+	out += 32;
+	out = serializeRuntime(out, &game->runtime);
+	serializeRuntime(out, &audio->runtime);
+	return true;
+}
+
+bool
+uw8Unserialize(Uw8Core* core, const void* data, size_t size) {
+	GameState* game = &core->game;
+	AudioState* audio = &core->audio;
+	if(size < uw8SerializeSize(core) || game->runtime.runtime == NULL)
+		return false;
+	const uint8_t* in = data;
+	if(getLe(in, 4) != SERIAL_MAGIC || getLe(in + 4, 4) != SERIAL_FORMAT || getLe(in + 8, 8) != game->moduleHash)
+		return false;
+	game->frameNumber = (uint32_t)getLe(in + 16, 4);
+	audio->sampleIndex = (uint32_t)getLe(in + 20, 4);
+	memcpy(audio->registers, in + 24, 32);
+	in += SERIAL_HEADER_SIZE;
+	in = unserializeRuntime(in, &game->runtime);
+	unserializeRuntime(in, &audio->runtime);
+	return true;
+}
+
+static void
+startMovie(const char* dir, uint64_t cartHash, bool record)
+{
+	snprintf(moviePath, sizeof(moviePath), "%s/%016llx.uw8m", dir, (unsigned long long)cartHash);
+	movieRecording = record;
+	if(record) {
+		movie = movieStartRecording(retroCore, cartHash, MOVIE_KEYFRAME_INTERVAL);
+		return;
+	}
+	movie = movieLoad(moviePath);
+	if(movie && (movieCartHash(movie) != cartHash || !movieSeek(movie, retroCore, 0))) {
+		log_cb(RETRO_LOG_WARN, "uw8: %s does not belong to this cart\n", moviePath);
+		movieFree(movie);
+		movie = NULL;
+	}
+}
 
-	gameState->memory = m3_GetMemory(gameState->runtime.runtime, NULL, 0);
-	assert(gameState->memory != NULL);
+// Recordings end on anything that changes the state besides the inputs.
+static void
+stopMovie(void)
+{
+	if(movie && movieRecording && !movieSave(movie, moviePath))
+		log_cb(RETRO_LOG_WARN, "uw8: could not write %s\n", moviePath);
+	movieFree(movie);
+	movie = NULL;
+}
 
-	gameState->hasUpdFunc = m3_FindFunction(&gameState->updFunc, gameState->runtime.runtime, "upd") == NULL;
+void
+retro_init(void)
+{
+	retroCore = uw8Create();
 
-	initRuntime(&audioState->runtime, gameState->env, cartWasm, cartSize);
-	audioState->memory = m3_GetMemory(audioState->runtime.runtime, NULL, 0);
-	audioState->hasSnd = m3_FindFunction(&audioState->snd, audioState->runtime.runtime, "snd") == NULL;
-	memcpy(audioState->registers, audioState->memory + 0x50, 32);
-	audioState->sampleIndex = 0;
+	inputBitmasks = environ_cb(RETRO_ENVIRONMENT_GET_INPUT_BITMASKS, NULL);
+	initInputTables();
+}
 
-	gameState->initialMemory = malloc(1 << 18);
-	memcpy(gameState->initialMemory, gameState->memory, 1 << 18);
+bool
+retro_load_game(const struct retro_game_info *game)
+{
+	enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+	struct retro_variable var = { "uw8_pixel_format", NULL };
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "RGB565") == 0)
+		fmt = RETRO_PIXEL_FORMAT_RGB565;
+	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt)) {
+		fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+		if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+			return false;
+	}
+	pixelFormat = fmt;
+
+	var.key = "uw8_threaded_video";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0)
+		videoWorker = workerCreate();
+
+	var.key = "uw8_lazy_compile";
+	var.value = NULL;
+	bool lazyCompile = environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0;
+
+	loadStart = timeMicros();
+	uint64_t cartHash = uw8Hash(game->data, game->size);
+	var.key = "uw8_profile";
+	var.value = NULL;
+	const char* saveDir = NULL;
+	profilePath[0] = 0;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0
+			&& environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &saveDir) && saveDir)
+		snprintf(profilePath, sizeof(profilePath), "%s/%016llx.folded", saveDir, (unsigned long long)cartHash);
+	uw8SetProfiling(retroCore, profilePath[0] != 0);
+
+	if(!uw8Load(retroCore, game->data, game->size, lazyCompile))
+		return false;
+
+	var.key = "uw8_movie";
+	var.value = NULL;
+	saveDir = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "disabled") != 0
+			&& environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &saveDir) && saveDir)
+		startMovie(saveDir, cartHash, strcmp(var.value, "record") == 0);
+
+	var.key = "uw8_hash_log";
+	var.value = NULL;
+	saveDir = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0
+			&& environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &saveDir) && saveDir) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%016llx.hashlog", saveDir, (unsigned long long)cartHash);
+		hashLog = hashLogOpen(path);
+		hashLogFrames = 0;
+	}
+
+	var.key = "uw8_trace";
+	var.value = NULL;
+	saveDir = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0
+			&& environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &saveDir) && saveDir) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%016llx.trace.json", saveDir, (unsigned long long)cartHash);
+		trace = traceOpen(path);
+		if(trace == NULL)
+			log_cb(RETRO_LOG_WARN, "uw8: could not write %s\n", path);
+		traceImportCalls = traceImportNanos = 0;
+	}
 
 	struct retro_input_descriptor desc[] = {
 		{ 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_LEFT,   "D-Pad Left" },
@@ -452,64 +1886,177 @@ retro_load_game(const struct retro_game_info *game)
 
 	environ_cb(RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS, desc);
 
+	logPeakMemory();
+
 	return true;
 }
 
-static const uint8_t retro_bind[] = {
-	[RETRO_DEVICE_ID_JOYPAD_UP] = 1<<0,
-	[RETRO_DEVICE_ID_JOYPAD_DOWN] = 1<<1,
-	[RETRO_DEVICE_ID_JOYPAD_LEFT] = 1<<2,
-	[RETRO_DEVICE_ID_JOYPAD_RIGHT] = 1<<3,
-	[RETRO_DEVICE_ID_JOYPAD_B] = 1<<4,
-	[RETRO_DEVICE_ID_JOYPAD_A] = 1<<5,
-	[RETRO_DEVICE_ID_JOYPAD_Y] = 1<<6,
-	[RETRO_DEVICE_ID_JOYPAD_X] = 1<<7,
-};
+typedef struct ResolveJob {
+	const uint8_t* memory;
+	enum retro_pixel_format format;
+	void* target;
+	size_t pitch;
+	TraceThread thread;
+} ResolveJob;
 
 void
-retro_run(void)
-{
-	input_poll_cb();
+resolveXRGB8888(const uint8_t* memory, void* target, size_t pitch) {
+	const uint32_t* palette = (const uint32_t*)(memory + 0x13000);
+	const uint8_t* pixels = memory + 120;
+	for(uint32_t y = 0; y < 240; ++y) {
+		uint32_t* row = (uint32_t*)((uint8_t*)target + y * pitch);
+		for(uint32_t x = 0; x < 320; ++x) {
+			uint32_t c = palette[*pixels++];
+			row[x] = (c & 0xff00ff00) | ((c & 0xff) << 16) | ((c >> 16) & 0xff);
+		}
+	}
+}
 
-	for(int p = 0; p < 4; p++) {
-		gameState->memory[0x00044+p] = 0;
-		for(int i = 0; i <= RETRO_DEVICE_ID_JOYPAD_R3; i++)
-			if(input_state_cb(p, RETRO_DEVICE_JOYPAD, 0, i))
-				gameState->memory[0x00044+p] ^= retro_bind[i];
+// The palette is converted once per frame, then each group of four indices
+// is looked up and written with a single 64 bit store.
+void
+resolveRGB565(const uint8_t* memory, void* target, size_t pitch) {
+	uint16_t palette565[256];
+	const uint32_t* palette = (const uint32_t*)(memory + 0x13000);
+	for(int i = 0; i < 256; ++i) {
+		uint32_t c = palette[i];
+		palette565[i] = ((c & 0xf8) << 8) | ((c >> 5) & 0x7e0) | ((c >> 19) & 0x1f);
 	}
 
-	if(gameState->hasUpdFunc) {
-		verifyM3(gameState->runtime.runtime, m3_CallV(gameState->updFunc));
+	const uint8_t* pixels = memory + 120;
+	for(uint32_t y = 0; y < 240; ++y) {
+		uint8_t* row = (uint8_t*)target + y * pitch;
+		for(uint32_t x = 0; x < 320; x += 4, pixels += 4) {
+			uint64_t quad = (uint64_t)palette565[pixels[0]]
+				| (uint64_t)palette565[pixels[1]] << 16
+				| (uint64_t)palette565[pixels[2]] << 32
+				| (uint64_t)palette565[pixels[3]] << 48;
+#if defined(MSB_FIRST)
+			quad = (quad >> 48) | ((quad >> 16) & 0xffff0000) | ((quad << 16) & 0xffff00000000ull) | (quad << 48);
+#endif
+			memcpy(row + x * sizeof(uint16_t), &quad, sizeof(quad));
+		}
 	}
-	memcpy(audioState->registers, gameState->memory + 0x50, 32);
+}
 
-	Z_platformZ_endFrame(&gameState->runtime.platform_c);
+void
+resolveFrame(void* arg) {
+	ResolveJob* job = arg;
+	traceBegin(trace, job->thread, TRACE_RESOLVE);
+	if(job->format == RETRO_PIXEL_FORMAT_RGB565)
+		resolveRGB565(job->memory, job->target, job->pitch);
+	else
+		resolveXRGB8888(job->memory, job->target, job->pitch);
+	traceEnd(trace, job->thread, TRACE_RESOLVE);
+}
 
-	uint32_t* palette = (uint32_t*)(gameState->memory + 0x13000);
-	uint8_t* pixels = gameState->memory + 120;
-	for(uint32_t i = 0; i < 320*240; ++i) {
-		uint32_t c = palette[pixels[i]];
-		gameState->pixels32[i] = (c & 0xff00ff00) | ((c & 0xff) << 16) | ((c >> 16) & 0xff);
+// The imports of each upd() as counters, as timing every call would cost
+// more than the calls themselves. Only available while profiling, whose
+// trampolines do the counting.
+static void
+traceImports(Uw8Core* core)
+{
+	if(core->profile == NULL)
+		return;
+	uint64_t calls = 0, nanos = 0;
+	for(uint32_t i = 0; i < IMPORT_COUNT; ++i) {
+		calls += core->profile->imports[PROFILE_UPD][i].calls;
+		nanos += core->profile->imports[PROFILE_UPD][i].nanos;
 	}
+	traceCounter(trace, TRACE_IMPORT_CALLS, (uint32_t)(calls - traceImportCalls));
+	traceCounter(trace, TRACE_IMPORT_MICROS, (uint32_t)((nanos - traceImportNanos) / 1000));
+	traceImportCalls = calls;
+	traceImportNanos = nanos;
+}
 
-	video_cb(gameState->pixels32, 320, 240, 320*sizeof(uint32_t));
 
-	memcpy(audioState->memory + 0x50, audioState->registers, 32);
-	for(int i = 0; i < 44100/60; ++i) {
-		float_t left, right;
-		if(audioState->hasSnd) {
-			m3_CallV(audioState->snd, audioState->sampleIndex++);
-			m3_GetResultsV(audioState->snd, &left);
-			m3_CallV(audioState->snd, audioState->sampleIndex++);
-			m3_GetResultsV(audioState->snd, &right);
-		} else {
-			left = Z_platformZ_sndGes(&audioState->runtime.platform_c, audioState->sampleIndex++);
-			right = Z_platformZ_sndGes(&audioState->runtime.platform_c, audioState->sampleIndex++);
+void
+retro_run(void)
+{
+	traceBegin(trace, TRACE_MAIN, TRACE_RUN);
+	traceBegin(trace, TRACE_MAIN, TRACE_INPUT);
+	input_poll_cb();
+
+	uint8_t buttons[4];
+	for(unsigned p = 0; p < 4; p++)
+		buttons[p] = portDevices[p] == RETRO_DEVICE_NONE ? 0 : readButtons(p);
+	if(movie && movieRecording) {
+		if(!movieRecordFrame(movie, retroCore, buttons)) {
+			log_cb(RETRO_LOG_ERROR, "uw8: out of memory, the recording ends at frame %u\n", movieFrameCount(movie));
+			stopMovie();
 		}
-		audio_cb((int16_t)(left * 32767.0f), (int16_t)(right * 32767.0f));
+	} else if(movie && !moviePlayFrame(movie, buttons))
+		stopMovie(); // live input from here on
+	traceEnd(trace, TRACE_MAIN, TRACE_INPUT);
+
+	traceBegin(trace, TRACE_MAIN, TRACE_UPD);
+	uw8RunFrame(retroCore, buttons);
+	traceEnd(trace, TRACE_MAIN, TRACE_UPD);
+	if(trace)
+		traceImports(retroCore);
+
+	// render straight into frontend memory when it offers a framebuffer
+	struct retro_framebuffer fb = { 0 };
+	fb.width = 320;
+	fb.height = 240;
+	fb.access_flags = RETRO_MEMORY_ACCESS_WRITE;
+	void* target;
+	size_t pitch;
+	if(environ_cb(RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER, &fb) && fb.format == pixelFormat) {
+		target = fb.data;
+		pitch = fb.pitch;
+	} else {
+		if(pixels == NULL)
+			pixels = malloc(320*240*sizeof(uint32_t));
+		target = pixels;
+		pitch = 320 * (pixelFormat == RETRO_PIXEL_FORMAT_RGB565 ? sizeof(uint16_t) : sizeof(uint32_t));
 	}
 
-	*(uint32_t*)&gameState->memory[0x00040] = gameState->frameNumber++ * 1000 / 60 + 8;
+	int16_t samples[UW8_SAMPLES_PER_FRAME * 2];
+	ResolveJob resolve = { uw8Memory(retroCore), pixelFormat, target, pitch, videoWorker ? TRACE_WORKER : TRACE_MAIN };
+	if(videoWorker) {
+		// Nothing writes to the game memory before the next frame, so the
+		// worker can read it directly while the audio is synthesized here.
+		workerStart(videoWorker, resolveFrame, &resolve);
+		traceBegin(trace, TRACE_MAIN, TRACE_SND);
+		uw8RenderAudio(retroCore, samples);
+		traceEnd(trace, TRACE_MAIN, TRACE_SND);
+		workerWait(videoWorker);
+		traceBegin(trace, TRACE_MAIN, TRACE_VIDEO);
+		video_cb(target, 320, 240, pitch);
+		traceEnd(trace, TRACE_MAIN, TRACE_VIDEO);
+	} else {
+		resolveFrame(&resolve);
+		traceBegin(trace, TRACE_MAIN, TRACE_VIDEO);
+		video_cb(target, 320, 240, pitch);
+		traceEnd(trace, TRACE_MAIN, TRACE_VIDEO);
+		traceBegin(trace, TRACE_MAIN, TRACE_SND);
+		uw8RenderAudio(retroCore, samples);
+		traceEnd(trace, TRACE_MAIN, TRACE_SND);
+	}
+	traceBegin(trace, TRACE_MAIN, TRACE_AUDIO);
+	for(int i = 0; i < UW8_SAMPLES_PER_FRAME; ++i)
+		audio_cb(samples[i * 2], samples[i * 2 + 1]);
+	traceEnd(trace, TRACE_MAIN, TRACE_AUDIO);
+
+	if(hashLog) {
+		const uint8_t* memory = uw8Memory(retroCore);
+		FrameHashes hashes;
+		hashes.framebuffer = hashLogHash(memory + UW8_FRAMEBUFFER, 320 * 240);
+		hashes.palette = hashLogHash(memory + UW8_PALETTE, 256 * 4);
+		hashes.audio = hashLogHash(samples, sizeof(samples));
+		hashLogFrame(hashLog, hashLogFrames++, &hashes);
+	}
+
+	if(loadStart) {
+		log_cb(RETRO_LOG_INFO, "uw8: first frame after %.2f ms (%s compilation)\n",
+			(timeMicros() - loadStart) / 1000.0, retroCore->game.lazyCompile ? "lazy" : "eager");
+		loadStart = 0;
+	}
+	if(trace) {
+		traceEnd(trace, TRACE_MAIN, TRACE_RUN);
+		traceFrame(trace);
+	}
 }
 
 void
@@ -534,6 +2081,24 @@ void
 retro_set_environment(retro_environment_t cb)
 {
 	environ_cb = cb;
+
+	static const struct retro_variable variables[] = {
+		{ "uw8_pixel_format", "Pixel format (restart); XRGB8888|RGB565" },
+		{ "uw8_threaded_video", "Threaded video resolve (restart); disabled|enabled" },
+		{ "uw8_lazy_compile", "Compile cart code on first use (restart); disabled|enabled" },
+		{ "uw8_movie", "Input movie in the save directory (restart); disabled|record|play" },
+		{ "uw8_hash_log", "Log output hashes for verification (restart); disabled|enabled" },
+		{ "uw8_profile", "Profile the cart into the save directory (restart); disabled|enabled" },
+		{ "uw8_trace", "Trace frame timeline into the save directory (restart); disabled|enabled" },
+		{ NULL, NULL },
+	};
+	cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)variables);
+
+	struct retro_log_callback logging;
+	if(cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &logging))
+		log_cb = logging.log;
+	else
+		log_cb = fallbackLog;
 }
 
 void
@@ -545,43 +2110,67 @@ retro_set_audio_sample(retro_audio_sample_t cb)
 void
 retro_reset(void)
 {
-	memcpy(gameState->memory, gameState->initialMemory, 1 << 18);
-	audioState->sampleIndex = 0;
-	gameState->frameNumber = 0;
+	stopMovie();
+	uw8Reset(retroCore);
 }
 
 size_t
 retro_serialize_size(void)
 {
-	return 1 << 18;
+	return uw8SerializeSize(retroCore);
 }
 
 bool
 retro_serialize(void *data, size_t size)
 {
-	memcpy(data, gameState->memory, 1 << 18);
-	return true;
+	return uw8Serialize(retroCore, data, size);
 }
 
 bool
 retro_unserialize(const void *data, size_t size)
 {
-	memcpy(gameState->memory, data, 1 << 18);
-	return true;
+	stopMovie();
+	return uw8Unserialize(retroCore, data, size);
+}
+
+void
+retro_unload_game(void)
+{
+	stopMovie();
+	hashLogClose(hashLog);
+	hashLog = NULL;
+	traceClose(trace);
+	trace = NULL;
+	if(profilePath[0] && uw8Memory(retroCore)) {
+		if(uw8WriteProfile(retroCore, profilePath))
+			log_cb(RETRO_LOG_INFO, "uw8: profile written to %s\n", profilePath);
+		profilePath[0] = 0;
+	}
+	workerDestroy(videoWorker);
+	videoWorker = NULL;
+	uw8Unload(retroCore);
 }
 
 void
 retro_deinit(void) {
-	m3_FreeRuntime(audioState->runtime.runtime);
-	m3_FreeRuntime(gameState->runtime.runtime);
-	m3_FreeEnvironment(gameState->env);
-	free(gameState->initialMemory);
-	free(gameState->pixels32);
+	retro_unload_game();
+#if d_m3EnableOpProfiling
+	m3_PrintProfilerInfo();
+#endif
+#if UW8_OP_PAIRS
+	printOpPairs();
+#endif
+	uw8Destroy(retroCore);
+	retroCore = NULL;
+	free(pixels);
+	pixels = NULL;
+}
 
-	free(audioState);
-	audioState = NULL;
-	free(gameState);
-	gameState = NULL;
+void
+retro_set_controller_port_device(unsigned port, unsigned device)
+{
+	if(port < 4)
+		portDevices[port] = device;
 }
 
 unsigned
@@ -589,10 +2178,8 @@ retro_get_region(void) {
 	return RETRO_REGION_NTSC;
 }
 
-void retro_set_controller_port_device(unsigned port, unsigned device) {}
 size_t retro_get_memory_size(unsigned id) { return 0; }
 void * retro_get_memory_data(unsigned id) { return NULL; }
-void retro_unload_game(void) {}
 void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) {}
 void retro_cheat_reset(void) {}
 void retro_cheat_set(unsigned index, bool enabled, const char *code) {}
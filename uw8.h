@@ -0,0 +1,68 @@
+#ifndef UW8_H
+#define UW8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One MicroW8 console: a cart's game and audio runtimes and all of their
+// state. Instances share nothing mutable, so several can run in parallel as
+// long as each one is used by a single thread at a time. The libretro entry
+// points drive one of them.
+typedef struct Uw8Core Uw8Core;
+
+#define UW8_MEMORY_SIZE (1 << 18)
+#define UW8_FRAMEBUFFER 120 // 320x240 palette indices
+#define UW8_PALETTE 0x13000 // 256 colors as 0xAABBGGRR
+#define UW8_SAMPLES_PER_FRAME (44100 / 60)
+
+Uw8Core* uw8Create(void);
+void uw8Destroy(Uw8Core* core);
+
+// Accepts .uw8 carts as well as plain wasm modules.
+bool uw8Load(Uw8Core* core, const uint8_t* cart, size_t cartSize, bool lazyCompile);
+void uw8Unload(Uw8Core* core);
+void uw8Reset(Uw8Core* core);
+
+// Runs upd() once with the buttons of the four gamepads.
+void uw8RunFrame(Uw8Core* core, const uint8_t buttons[4]);
+// Synthesizes the last frame's sound as interleaved stereo samples,
+// UW8_SAMPLES_PER_FRAME * 2 of them.
+void uw8RenderAudio(Uw8Core* core, int16_t* samples);
+// The game's linear memory, NULL while no cart is loaded.
+uint8_t* uw8Memory(Uw8Core* core);
+// The platform's random number generator state.
+uint64_t uw8RandomState(Uw8Core* core);
+// FNV-1a, which names a cart's files and identifies its module in states.
+uint64_t uw8Hash(const void* data, size_t size);
+
+// Snapshots of a running instance, e.g. for tree search. Besides both
+// memories they hold the platform's and the cart's globals. Only the pages
+// that differ from the cart's initial image are copied.
+typedef struct Uw8State Uw8State;
+Uw8State* uw8StateSave(Uw8Core* core);
+// Fails for states saved from a different cart.
+bool uw8StateLoad(Uw8Core* core, const Uw8State* state);
+void uw8StateFree(Uw8State* state);
+// Saved states as portable little-endian bytes.
+size_t uw8StateSize(const Uw8State* state);
+void uw8StateWrite(const Uw8State* state, void* data);
+Uw8State* uw8StateRead(const void* data, size_t size);
+// A new instance running the same cart in the same state, for exploring
+// branches in parallel. The cart is parsed again, so this is far more
+// expensive than saving a state.
+Uw8Core* uw8Clone(Uw8Core* core);
+
+// Profiling of the cart's entry points, its functions by their names in
+// the name section and the platform functions they call, taking effect
+// with the next uw8Load.
+void uw8SetProfiling(Uw8Core* core, bool enabled);
+// Writes the profile as collapsed stacks for flame graph tools.
+bool uw8WriteProfile(Uw8Core* core, const char* path);
+
+// Complete states in a flat buffer, for the frontend's savestates.
+size_t uw8SerializeSize(Uw8Core* core);
+bool uw8Serialize(Uw8Core* core, void* data, size_t size);
+bool uw8Unserialize(Uw8Core* core, const void* data, size_t size);
+
+#endif
@@ -0,0 +1,368 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "uw8math.h"
+
+// Fused multiply-adds would round differently from separate operations.
+// Bit-reproducibility also needs double arithmetic without excess
+// precision (i.e. no x87) and no -ffast-math.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#ifdef __FAST_MATH__
+#error "uw8math.c must be built with -fno-fast-math"
+#endif
+
+// 32-bit x86 compilers default to x87 code. Move the arithmetic to SSE2
+// unless this is the DOS build, which targets a 386 and uses -ffloat-store.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__i386__) && \
+	!defined(__SSE2_MATH__) && !defined(__DJGPP__)
+#pragma GCC target ("sse2", "fpmath=sse")
+#endif
+
+#define PI 3.14159265358979311600e+00
+#define PI_2 1.57079632679489655800e+00
+#define PI_4 7.85398163397448278999e-01
+#define SQRT2 1.41421356237309514547e+00
+#define INV_PIO2 6.36619772367581382433e-01
+#define PIO2_1 1.57079632673412561417e+00 // first 33 bits of pi/2
+#define PIO2_1T 6.07710050650619224932e-11 // pi/2 - PIO2_1
+#define INV_LN2 1.44269504088896338700e+00
+#define LN2_HI 6.93147180369123816490e-01 // first 32 bits of ln(2)
+#define LN2_LO 1.90821492927058770002e-10 // ln(2) - LN2_HI
+
+static float
+nanResult(void)
+{
+	uint32_t bits = 0x7fc00000;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static int
+roundToInt(double x)
+{
+	return (int)(x < 0 ? x - 0.5 : x + 0.5);
+}
+
+static double
+pow2(int k)
+{
+	uint64_t bits = (uint64_t)(k + 1023) << 52;
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+// The first 320 bits of 2/pi, for reducing huge arguments.
+static const uint32_t twoOverPi[] = {
+	0xa2f9836e, 0x4e441529, 0xfc2757d1, 0xf534ddc0, 0xdb629599,
+	0x3c439041, 0xfe5163ab, 0xdebbc561, 0xb7246e3a, 0x424dd2e0,
+};
+
+// 32 bits of 2/pi starting at bit start, where bit 1 is the first one
+// after the binary point.
+static uint32_t
+twoOverPiWord(int start)
+{
+	if(start < 1)
+		return twoOverPiWord(1) >> (1 - start);
+	int j = start - 1;
+	int shift = j % 32;
+	uint32_t word = twoOverPi[j / 32] << shift;
+	if(shift)
+		word |= twoOverPi[j / 32 + 1] >> (32 - shift);
+	return word;
+}
+
+// Payne-Hanek reduction for |x| >= 2^20. x is m * 2^e with an integer
+// mantissa m, so only 96 bits of 2/pi around 2^-e matter for x * 2/pi
+// modulo 4.
+static int
+reduceLarge(float x, double* r)
+{
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int e = (int)((bits >> 23) & 0xff) - 150;
+	uint64_t m = (bits & 0x7fffff) | 0x800000;
+
+	int start = e - 1;
+	uint64_t p2 = m * twoOverPiWord(start + 64);
+	uint64_t p1 = m * twoOverPiWord(start + 32) + (p2 >> 32);
+	uint64_t p0 = m * twoOverPiWord(start) + (p1 >> 32);
+	int k = (int)((p0 >> 30) & 3);
+	uint64_t fraction = (p0 << 34) | ((p1 & 0xffffffff) << 2) | ((p2 & 0xffffffff) >> 30);
+	double f = (double)fraction * (1.0 / 18446744073709551616.0);
+	if(f >= 0.5) {
+		f -= 1;
+		++k;
+	}
+	*r = f * PI_2;
+	if(x < 0) {
+		*r = -*r;
+		k = -k;
+	}
+	return k;
+}
+
+// Reduces x to r in [-pi/4, pi/4] and returns the number of quarter turns
+// that were removed.
+static int
+reducePio2(float x, double* r)
+{
+	if(x > 1048576.0f || x < -1048576.0f)
+		return reduceLarge(x, r);
+	int k = roundToInt(x * INV_PIO2);
+	*r = ((double)x - k * PIO2_1) - k * PIO2_1T;
+	return k;
+}
+
+// Taylor series up to r^15 and r^16, below 1e-16 on [-pi/4, pi/4].
+static double
+sinKernel(double r)
+{
+	double r2 = r * r;
+	return r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040 + r2 * (1.0 / 362880
+		+ r2 * (-1.0 / 39916800 + r2 * (1.0 / 6227020800 + r2 * (-1.0 / 1307674368000)))))));
+}
+
+static double
+cosKernel(double r)
+{
+	double r2 = r * r;
+	return 1 + r2 * (-1.0 / 2 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320
+		+ r2 * (-1.0 / 3628800 + r2 * (1.0 / 479001600 + r2 * (-1.0 / 87178291200
+		+ r2 * (1.0 / 20922789888000))))))));
+}
+
+// Only valid for |x| <= 200, far beyond the range of float results.
+static double
+expKernel(double x)
+{
+	int k = roundToInt(x * INV_LN2);
+	double r = (x - k * LN2_HI) - k * LN2_LO;
+	double p = 1 + r * (1 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120
+		+ r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 + r * (1.0 / 362880
+		+ r * (1.0 / 3628800 + r * (1.0 / 39916800 + r * (1.0 / 479001600
+		+ r * (1.0 / 6227020800)))))))))))));
+	return p * pow2(k);
+}
+
+// x has to be positive, finite and normal.
+static double
+logKernel(double x)
+{
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int e = (int)((bits >> 52) & 0x7ff) - 1023;
+	bits = (bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+	double m;
+	memcpy(&m, &bits, sizeof(m));
+	if(m > SQRT2) {
+		m *= 0.5;
+		++e;
+	}
+	// log(m) = 2 atanh(s) with |s| <= 0.172
+	double s = (m - 1) / (m + 1);
+	double s2 = s * s;
+	double p = 2 * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9
+		+ s2 * (1.0 / 11 + s2 * (1.0 / 13 + s2 * (1.0 / 15 + s2 * (1.0 / 17
+		+ s2 * (1.0 / 19 + s2 * (1.0 / 21)))))))))));
+	return e * LN2_HI + (e * LN2_LO + p);
+}
+
+static double
+atanKernel(double x)
+{
+	double a = x < 0 ? -x : x;
+	int inverted = a > 1;
+	if(inverted)
+		a = 1 / a;
+	// halve the angle twice, leaving |a| <= tan(pi/16)
+	a = a / (1 + sqrt(1 + a * a));
+	a = a / (1 + sqrt(1 + a * a));
+	double a2 = a * a;
+	double p = a * (1 - a2 * (1.0 / 3 - a2 * (1.0 / 5 - a2 * (1.0 / 7 - a2 * (1.0 / 9
+		- a2 * (1.0 / 11 - a2 * (1.0 / 13 - a2 * (1.0 / 15 - a2 * (1.0 / 17
+		- a2 * (1.0 / 19 - a2 * (1.0 / 21 - a2 * (1.0 / 23))))))))))));
+	p *= 4;
+	if(inverted)
+		p = PI_2 - p;
+	return x < 0 ? -p : p;
+}
+
+float
+uw8Sin(float x)
+{
+	if(isnan(x) || isinf(x))
+		return nanResult();
+	if(x == 0)
+		return x;
+	double r;
+	switch(reducePio2(x, &r) & 3) {
+	case 0: return (float)sinKernel(r);
+	case 1: return (float)cosKernel(r);
+	case 2: return (float)-sinKernel(r);
+	default: return (float)-cosKernel(r);
+	}
+}
+
+float
+uw8Cos(float x)
+{
+	if(isnan(x) || isinf(x))
+		return nanResult();
+	double r;
+	switch(reducePio2(x, &r) & 3) {
+	case 0: return (float)cosKernel(r);
+	case 1: return (float)-sinKernel(r);
+	case 2: return (float)-cosKernel(r);
+	default: return (float)sinKernel(r);
+	}
+}
+
+float
+uw8Tan(float x)
+{
+	if(isnan(x) || isinf(x))
+		return nanResult();
+	if(x == 0)
+		return x;
+	double r;
+	int k = reducePio2(x, &r);
+	if(k & 1)
+		return (float)(-cosKernel(r) / sinKernel(r));
+	return (float)(sinKernel(r) / cosKernel(r));
+}
+
+float
+uw8Asin(float x)
+{
+	if(isnan(x) || x > 1 || x < -1)
+		return nanResult();
+	if(x == 0)
+		return x;
+	return (float)atanKernel(x / sqrt((1 - (double)x) * (1 + (double)x)));
+}
+
+float
+uw8Acos(float x)
+{
+	if(isnan(x) || x > 1 || x < -1)
+		return nanResult();
+	return (float)(2 * atanKernel(sqrt((1 - (double)x) / (1 + (double)x))));
+}
+
+float
+uw8Atan(float x)
+{
+	if(isnan(x))
+		return nanResult();
+	if(x == 0)
+		return x;
+	return (float)atanKernel(x);
+}
+
+float
+uw8Atan2(float y, float x)
+{
+	if(isnan(x) || isnan(y))
+		return nanResult();
+	if(y == 0) {
+		if(signbit(x))
+			return signbit(y) ? (float)-PI : (float)PI;
+		return y;
+	}
+	if(x == 0)
+		return y > 0 ? (float)PI_2 : (float)-PI_2;
+	if(isinf(x)) {
+		if(isinf(y)) {
+			double a = x > 0 ? PI_4 : 3 * PI_4;
+			return (float)(y > 0 ? a : -a);
+		}
+		if(x > 0)
+			return y > 0 ? 0.0f : -0.0f;
+		return y > 0 ? (float)PI : (float)-PI;
+	}
+	if(isinf(y))
+		return y > 0 ? (float)PI_2 : (float)-PI_2;
+	double a = atanKernel((double)y / x);
+	if(x < 0)
+		a += y > 0 ? PI : -PI;
+	return (float)a;
+}
+
+float
+uw8Exp(float x)
+{
+	if(isnan(x))
+		return nanResult();
+	if(x > 100)
+		return INFINITY;
+	if(x < -110)
+		return 0;
+	return (float)expKernel(x);
+}
+
+float
+uw8Log(float x)
+{
+	if(isnan(x) || x < 0)
+		return nanResult();
+	if(x == 0)
+		return -INFINITY;
+	if(isinf(x))
+		return x;
+	return (float)logKernel(x);
+}
+
+// 0 if y is not an integer, 1 if it is odd and 2 if it is even.
+static int
+integerKind(float y)
+{
+	float a = y < 0 ? -y : y;
+	if(a >= 16777216.0f)
+		return 2;
+	int32_t i = (int32_t)a;
+	if((float)i != a)
+		return 0;
+	return (i & 1) ? 1 : 2;
+}
+
+float
+uw8Pow(float x, float y)
+{
+	if(y == 0 || x == 1)
+		return 1;
+	if(isnan(x) || isnan(y))
+		return nanResult();
+
+	float ax = x < 0 ? -x : x;
+	if(isinf(y)) {
+		if(ax == 1)
+			return 1;
+		return (ax < 1) == (y < 0) ? INFINITY : 0.0f;
+	}
+
+	int kind = integerKind(y);
+	int negative = x < 0 || (x == 0 && signbit(x));
+	float sign = negative && kind == 1 ? -1.0f : 1.0f;
+	if(x == 0)
+		return y < 0 ? sign * INFINITY : sign * 0.0f;
+	if(isinf(x))
+		return y < 0 ? sign * 0.0f : sign * INFINITY;
+	if(x < 0 && kind == 0)
+		return nanResult();
+
+	double t = y * logKernel(ax);
+	if(t > 100)
+		return sign * INFINITY;
+	if(t < -110)
+		return sign * 0.0f;
+	return sign * (float)expKernel(t);
+}
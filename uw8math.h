@@ -0,0 +1,19 @@
+#ifndef UW8MATH_H
+#define UW8MATH_H
+
+// Math functions offered to carts. Unlike libm these give the same bits on
+// every platform, so that carts (and their sound) stay in sync across
+// netplay peers. Everything is evaluated in double precision using only
+// correctly rounded IEEE operations and rounded to float once at the end.
+float uw8Acos(float x);
+float uw8Asin(float x);
+float uw8Atan(float x);
+float uw8Atan2(float y, float x);
+float uw8Cos(float x);
+float uw8Exp(float x);
+float uw8Log(float x);
+float uw8Sin(float x);
+float uw8Tan(float x);
+float uw8Pow(float x, float y);
+
+#endif
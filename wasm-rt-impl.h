@@ -28,7 +28,7 @@ extern "C" {
 #endif
 
 /** A setjmp buffer used for handling traps. */
-extern jmp_buf wasm_rt_jmp_buf;
+extern WASM_RT_THREAD_LOCAL jmp_buf wasm_rt_jmp_buf;
 
 #if WASM_RT_MEMCHECK_SIGNAL_HANDLER && !defined(_WIN32)
 #define WASM_RT_LONGJMP(buf, val) siglongjmp(buf, val)
@@ -38,7 +38,7 @@ extern jmp_buf wasm_rt_jmp_buf;
 
 #if WASM_RT_USE_STACK_DEPTH_COUNT
 /** Saved call stack depth that will be restored in case a trap occurs. */
-extern uint32_t wasm_rt_saved_call_stack_depth;
+extern WASM_RT_THREAD_LOCAL uint32_t wasm_rt_saved_call_stack_depth;
 #define WASM_RT_SAVE_STACK_DEPTH() \
   wasm_rt_saved_call_stack_depth = wasm_rt_call_stack_depth
 #else
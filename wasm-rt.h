@@ -100,6 +100,21 @@ extern "C" {
 #endif
 #endif
 
+/**
+ * Storage class of the trap state, which is kept per thread so that module
+ * instances can run on several threads at once. Builds without HAVE_THREADS
+ * run everything on one thread and may lack thread-local storage.
+ */
+#if !defined(HAVE_THREADS)
+#define WASM_RT_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define WASM_RT_THREAD_LOCAL __declspec(thread)
+#elif defined(__cplusplus)
+#define WASM_RT_THREAD_LOCAL thread_local
+#else
+#define WASM_RT_THREAD_LOCAL _Thread_local
+#endif
+
 #if WASM_RT_USE_STACK_DEPTH_COUNT
 /**
  * When the signal handler cannot be used to detect stack overflows, stack depth
@@ -116,7 +131,7 @@ extern "C" {
 #endif
 
 /** Current call stack depth. */
-extern uint32_t wasm_rt_call_stack_depth;
+extern WASM_RT_THREAD_LOCAL uint32_t wasm_rt_call_stack_depth;
 
 #endif
 
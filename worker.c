@@ -0,0 +1,121 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "worker.h"
+
+#ifdef HAVE_THREADS
+
+#include <pthread.h>
+
+struct Worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	WorkerJob job;
+	void* arg;
+	bool busy;
+	bool quit;
+};
+
+static void*
+workerMain(void* arg)
+{
+	Worker* worker = arg;
+	pthread_mutex_lock(&worker->mutex);
+	for(;;) {
+		while(!worker->busy && !worker->quit)
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+		if(!worker->busy)
+			break;
+		pthread_mutex_unlock(&worker->mutex);
+		worker->job(worker->arg);
+		pthread_mutex_lock(&worker->mutex);
+		worker->busy = false;
+		pthread_cond_broadcast(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->mutex);
+	return NULL;
+}
+
+Worker*
+workerCreate(void)
+{
+	Worker* worker = calloc(1, sizeof(Worker));
+	if(worker == NULL)
+		return NULL;
+	pthread_mutex_init(&worker->mutex, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	if(pthread_create(&worker->thread, NULL, workerMain, worker) != 0) {
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+		free(worker);
+		return NULL;
+	}
+	return worker;
+}
+
+void
+workerDestroy(Worker* worker)
+{
+	if(worker == NULL)
+		return;
+	pthread_mutex_lock(&worker->mutex);
+	worker->quit = true;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+	pthread_join(worker->thread, NULL);
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->mutex);
+	free(worker);
+}
+
+void
+workerStart(Worker* worker, WorkerJob job, void* arg)
+{
+	pthread_mutex_lock(&worker->mutex);
+	worker->job = job;
+	worker->arg = arg;
+	worker->busy = true;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+void
+workerWait(Worker* worker)
+{
+	pthread_mutex_lock(&worker->mutex);
+	while(worker->busy)
+		pthread_cond_wait(&worker->cond, &worker->mutex);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+#else
+
+struct Worker {
+	int unused;
+};
+
+Worker*
+workerCreate(void)
+{
+	return calloc(1, sizeof(Worker));
+}
+
+void
+workerDestroy(Worker* worker)
+{
+	free(worker);
+}
+
+void
+workerStart(Worker* worker, WorkerJob job, void* arg)
+{
+	job(arg);
+}
+
+void
+workerWait(Worker* worker)
+{
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+// A background thread that runs one job at a time. Without HAVE_THREADS
+// workerStart runs the job immediately on the calling thread.
+typedef struct Worker Worker;
+typedef void (*WorkerJob)(void* arg);
+
+Worker* workerCreate(void);
+void workerDestroy(Worker* worker);
+
+// Hands a job to the worker. The previous job must have been waited for.
+void workerStart(Worker* worker, WorkerJob job, void* arg);
+void workerWait(Worker* worker);
+
+#endif